@@ -0,0 +1,19 @@
+#include <cstring>
+#include "apm.h"
+
+APM::APM(int k, const int* n): K(k) {
+  size_t rows=0;
+  for (int i=0; i<K; ++i)
+    rows+=n[i];
+  mem=new char[rows*32*sizeof(U32)+MIXALIGN];
+  t=(U32*)(mem+(MIXALIGN-size_t(mem)%MIXALIGN)%MIXALIGN);
+  U32 row[32];
+  for (int j=0; j<32; ++j)
+    row[j]=squash((j-16)*128)*16 | U32(squash((j-15)*128)*16)<<16;
+  U32* p=t;
+  for (int i=0; i<K; ++i) {
+    map[i]=cur[i]=p;
+    for (int c=0; c<n[i]; ++c, p+=32)
+      memcpy(p, row, sizeof(row));
+  }
+}
@@ -0,0 +1,74 @@
+#ifndef _APM_
+#define _APM_
+
+#include "models/utils/datatypes.h"
+#include "mixer.h"
+
+/* Adaptive probability maps, after paq8f.  An APM refines a probability
+given a context: it maps the stretched probability, interpolated between
+33 buckets, and the context to a new probability, and after each bit
+moves the two buckets used toward the bit, so it learns how far off the
+input probability is in each context.
+
+   APM a(k, n) creates a chain of k <= MAXAPMS maps, map i with n[i]
+     contexts.  Each bucket starts at the probability it maps from, so
+     a new map changes nothing.
+   a.p(pr, cx) returns the average of the refinements of the 12 bit
+     probability pr by each map i in context cx[i], 0 <= cx[i] < n[i],
+     as a 16 bit probability.
+   a.update(y) moves the buckets used by the last p() toward bit y
+     (0 or 1) at rate 1/2^APMRATE.
+
+   The 33 buckets of a context are stored as 32 pairs of 16 bit values
+   (bucket j, bucket j+1), in 128 bytes (two cache lines) aligned to
+   MIXALIGN, 64 bytes, so the two buckets to interpolate are one
+   aligned 32-bit load that never straddles a cache line.  Bucket j+1 of pair j is also bucket j+1 of
+   pair j+1, and update() writes both copies, so this gives the same
+   results as a table of 33.  All maps of a chain are in one allocation
+   and are updated in one loop.  The loop is scalar.  Each map reads
+   and writes one pair and its neighbours per bit, in a row chosen by
+   its context, so with at most MAXAPMS maps the work is a few
+   scattered loads and stores rather than arithmetic for vector
+   instructions to share.
+*/
+
+enum {MAXAPMS=4, APMRATE=7};
+
+class APM {
+  const int K;   // Number of maps
+  char* mem;     // Allocation holding t
+  U32* t;        // For each context of each map, 32 pairs of buckets
+  U32* map[MAXAPMS];  // First pair of each map
+  U32* cur[MAXAPMS];  // Pair used by the last p() in each map
+public:
+  APM(int k, const int* n);
+  int p(int pr, const int* cx) {
+    pr=stretch(pr)+2048;
+    const int j=pr>>7, w=pr&127;
+    int sum=0;
+    for (int i=0; i<K; ++i) {
+      const U32 e=*(cur[i]=map[i]+cx[i]*32+j);
+      sum+=((e&0xffff)*(128-w)+(e>>16)*w)>>7;
+    }
+    return sum/K;
+  }
+  void update(int y) {
+    const int g=(y<<16)+(y<<APMRATE)-y-y;
+    for (int i=0; i<K; ++i) {
+      U32* e=cur[i];
+      int a=*e&0xffff, b=*e>>16;
+      a+=(g-a)>>APMRATE;
+      b+=(g-b)>>APMRATE;
+      *e=a|U32(b)<<16;
+      const int j=(e-t)&31;
+      if (j>0) e[-1]=(e[-1]&0xffff)|U32(a)<<16;
+      if (j<31) e[1]=(e[1]&0xffff0000)|b;
+    }
+  }
+  ~APM() {delete[] mem;}
+private:
+  APM(const APM&);  // No copy or assignment
+  APM& operator=(const APM&);
+};
+
+#endif
@@ -0,0 +1,998 @@
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <deque>
+#include "archive.h"
+#include "io.h"
+#include "crc.h"
+#include "thread.h"
+
+// Write n, MSB first, in the given number of bytes
+static void putN(FILE* f, U64 n, int bytes) {
+  for (int i=bytes-1; i>=0; --i)
+    putc(int(n>>(i*8))&255, f);
+}
+
+// Read a number written by putN, or set eof
+static U64 getN(FILE* f, int bytes, bool& eof) {
+  U64 n=0;
+  for (int i=0; i<bytes; ++i) {
+    int c=getc(f);
+    if (c==EOF) eof=true;
+    n=(n<<8)+(c&255);
+  }
+  return n;
+}
+
+// Read the rest of a text header line beginning with s up to the first
+// control character.  Skips LF in CR LF.
+static string getLine(FILE* f, string s="") {
+  int c;
+  while ((c=getc(f))!=EOF && c>=32)
+    s+=char(c);
+  if (c=='\r')
+    (void) getc(f);
+  return s;
+}
+
+//////////////////////////// ArchiveHeader ////////////////////////////
+
+void ArchiveHeader::write(FILE* f) const {
+  fputs("PAQB", f);
+  putc(6, f);
+  putN(f, file.size(), 4);
+  putN(f, block.size(), 4);
+  for (int i=0; i<int(file.size()); ++i) {
+    putN(f, file[i].size, 8);
+    putN(f, file[i].offset, 8);
+    putN(f, file[i].crc, 4);
+    putN(f, file[i].name.size(), 2);
+    fputs(file[i].name.c_str(), f);
+  }
+  for (int i=0; i<int(block.size()); ++i) {
+    const ArchiveBlock& b=block[i];
+    putN(f, b.offset, 8);
+    putN(f, b.csize, 8);
+    putN(f, b.uoffset, 8);
+    putN(f, b.usize, 8);
+    putN(f, b.crc, 4);
+    putN(f, b.prime, 4);
+    putc(b.coder, f);
+    putc(b.model, f);
+    putc(b.type, f);
+    putc(b.mixer, f);
+    putc(b.apm, f);
+  }
+}
+
+bool ArchiveHeader::read(FILE* f) {
+  file.clear();
+  block.clear();
+  stream=false;
+  string magic;
+  for (int i=0; i<4; ++i) {
+    int c=getc(f);
+    if (c<32)
+      return false;
+    magic+=char(c);
+  }
+
+  // Binary header
+  if (magic=="PAQB") {
+    bool eof=false;
+    const int version=getc(f);
+    if (version<1 || version>6)
+      return false;
+    if (version<5) {
+      printf("Archive format version %d is no longer supported: its blocks "
+        "were coded\nwith a predictor this version does not have\n",
+        version);
+      exit(1);
+    }
+    const U32 nfiles=getN(f, 4, eof);
+    const U32 nblocks=getN(f, 4, eof);
+    for (U32 i=0; i<nfiles && !eof; ++i) {
+      ArchiveFile af;
+      af.size=getN(f, 8, eof);
+      af.offset=getN(f, 8, eof);
+      af.crc=getN(f, 4, eof);
+      for (int n=getN(f, 2, eof); n>0 && !eof; --n) {
+        int c=getc(f);
+        if (c==EOF) eof=true;
+        af.name+=char(c);
+      }
+      file.push_back(af);
+    }
+    for (U32 i=0; i<nblocks && !eof; ++i) {
+      ArchiveBlock b;
+      b.offset=getN(f, 8, eof);
+      b.csize=getN(f, 8, eof);
+      b.uoffset=getN(f, 8, eof);
+      b.usize=getN(f, 8, eof);
+      b.crc=getN(f, 4, eof);
+      b.prime=getN(f, 4, eof);
+      b.coder=getc(f);
+      b.model=getc(f);
+      b.type=getc(f);
+      b.mixer=getc(f);
+      b.apm=version>=6 ? getc(f) : 0;
+      if (b.coder<0 || b.coder>=NCODERS || b.model<0
+          || b.model>=NMODELCONFIGS || b.prime>b.uoffset || b.type<0
+          || b.type>=NTYPES || b.mixer<0 || b.mixer>=1<<NMIXCONTEXTS
+          || b.apm<0 || b.apm>=1<<NAPMCONTEXTS)
+        return false;
+      block.push_back(b);
+    }
+    return !eof;
+  }
+
+  // Text header of a stream: coder tag, then "stream crc32c model M
+  // mixer X apm A", then "\032\f\0"
+  const int coder=coderOfTag(getLine(f, magic));
+  if (coder<0)
+    return false;
+  const string s=getLine(f);
+  char m[32], x[32], a[32];
+  if (sscanf(s.c_str(), "stream crc32c model %31s mixer %31s apm %31s",
+      m, x, a)!=3) {
+    printf("Archives with a text header are no longer supported, except "
+      "streams\nthat record their models\n");
+    exit(1);
+  }
+  if (getc(f)!=032 || getc(f)!='\f' || getc(f)!=0)
+    return false;
+  stream=true;
+  ArchiveBlock b;
+  b.offset=ftell64(f);
+  b.csize=0;  // Unknown
+  b.uoffset=0;
+  b.usize=~U64(0);
+  b.crc=0;
+  b.prime=0;
+  b.coder=coder;
+  b.model=modelOfName(m);
+  b.type=UNTYPED;
+  b.mixer=mixerContexts(x);
+  b.apm=apmContexts(a);
+  if (b.model<0 || b.mixer<0 || b.apm<0)
+    return false;
+  block.push_back(b);
+  return true;
+}
+
+void ArchiveHeader::list() const {
+  for (int i=0; i<int(file.size()); ++i) {
+    printf("%12lld %08x %s\n", (long long)file[i].size, file[i].crc,
+      file[i].name.c_str());
+  }
+  for (int i=0; i<int(block.size()); ++i) {
+    const ArchiveBlock& b=block[i];
+    printf("block %d: %lld bytes at %lld -> %lld bytes at %lld, %s model %s",
+      i, (long long)b.usize, (long long)b.uoffset, (long long)b.csize,
+      (long long)b.offset, coderName(Coder(b.coder)), modelName(b.model));
+    if (b.type!=UNTYPED)
+      printf(" %s", typeName(b.type));
+    printf(" mixer %s apm %s", mixerContextNames(b.mixer).c_str(),
+      apmContextNames(b.apm).c_str());
+    if (!stream)
+      printf(", crc %08x", b.crc);
+    if (b.prime)
+      printf(", primed with %u", b.prime);
+    printf("\n");
+  }
+}
+
+///////////////////////////// Entropy /////////////////////////////
+
+// Bits per byte above which a block is stored (option -e)
+double storebits=7.9;
+
+// Run each model in its own thread in compressBlocks() (option -m)
+bool modelthreads=false;
+
+// Blocks coded at once by each thread (option -k)
+int interleave=1;
+
+// Pin coding threads to CPUs, with their models on the local NUMA node
+// (option -g)
+bool pinthreads=false;
+
+// Print the NUMA nodes of the models' pages after each block (option -r)
+bool numareport=false;
+
+double entropyEstimate(const U8* buf, size_t n) {
+  if (n==0)
+    return 0;
+  vector<U32> t0(256), t1(16*256);
+  int c1=0;
+  for (size_t i=0; i<n; ++i) {
+    ++t0[buf[i]];
+    ++t1[c1<<8|buf[i]];
+    c1=buf[i]>>4;
+  }
+
+  // Sum over contexts of n H + (k-1)/(2 ln 2) = sum n log n - sum t log t
+  // + (k-1)/(2 ln 2), in bits, for counts t of k distinct bytes
+  const double corr=0.5/log(2.0);
+  double h0=0, h1=0;
+  for (int cx=0; cx<=16; ++cx) {
+    const U32* t=cx<16 ? &t1[cx<<8] : &t0[0];
+    double h=0, m=0;
+    int k=0;
+    for (int j=0; j<256; ++j) {
+      if (t[j]) {
+        h-=t[j]*log2(double(t[j]));
+        m+=t[j];
+        ++k;
+      }
+    }
+    if (k==0)
+      continue;
+    h+=m*log2(m)+(k-1)*corr;
+    if (cx<16)
+      h1+=h;
+    else
+      h0=h;
+  }
+  return min(h0, h1)/n;
+}
+
+/////////////////////////// probeBlocks ///////////////////////////
+
+// Index of the first file in h that ends after offset u of the
+// concatenation of all files, or h.file.size()
+static int firstFile(const ArchiveHeader& h, U64 u) {
+  int lo=0, hi=h.file.size();
+  while (lo<hi) {
+    const int mid=(lo+hi)/2;
+    if (U64(h.file[mid].offset+h.file[mid].size)<=u)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return lo;
+}
+
+// The part of file number file read into a block, and its CRC
+struct Piece {
+  int file;
+  U64 len;
+  U32 crc;
+};
+
+// Read up to n bytes at offset u of the concatenation of the files in h
+// into buf and return the number read.  Files are read from a mapping
+// if possible (see usemmap), else with fread().  A file that is missing
+// or shorter than its size in h reads as zeros past its end, as when
+// compressing serially.  If pieces is not 0, append the CRC of the part
+// of each file read, padding included.
+static size_t readFiles(const ArchiveHeader& h, U64 u, U8* buf, size_t n,
+    vector<Piece>* pieces=0) {
+  size_t done=0;
+  for (int i=firstFile(h, u); i<int(h.file.size()) && done<n; ++i) {
+    const ArchiveFile& af=h.file[i];
+    if (af.size==0)
+      continue;
+    const size_t k=min(U64(n-done), U64(af.offset+af.size)-u);
+    const U64 at=u-af.offset;  // Offset in the file
+    size_t r=0;
+    MappedFile m;
+    if (usemmap && m.open(af.name.c_str())) {
+      if (at<m.size())
+        r=min(U64(k), m.size()-at);
+      memcpy(buf+done, m.data()+at, r);
+    }
+    else {
+      FILE* f=fopen(af.name.c_str(), "rb");
+      if (f) {
+        fseek64(f, at, SEEK_SET);
+        r=fread(buf+done, 1, k, f);
+        fclose(f);
+      }
+    }
+    memset(buf+done+r, 0, k-r);
+    if (pieces) {
+      Piece p={i, k, crc32c(0, buf+done, k)};
+      pieces->push_back(p);
+    }
+    done+=k;
+    u+=k;
+  }
+  return done;
+}
+
+void probeBlocks(ArchiveHeader& h) {
+  enum {SEGMENTS=8, SEG=PROBE/SEGMENTS};
+  vector<U8> sample(PROBE);
+  for (int b=0; b<int(h.block.size()); ++b) {
+    ArchiveBlock& bk=h.block[b];
+    if (bk.coder==STORED)
+      continue;
+    size_t n=0;
+    if (bk.usize<=PROBE)
+      n=readFiles(h, bk.uoffset, &sample[0], size_t(bk.usize));
+    else
+      for (int i=0; i<SEGMENTS; ++i)
+        n+=readFiles(h, bk.uoffset+(bk.usize-SEG)*i/(SEGMENTS-1),
+          &sample[n], SEG);
+    if (n>0 && entropyEstimate(&sample[0], n)>storebits) {
+      bk.coder=STORED;
+      bk.prime=0;
+    }
+  }
+}
+
+//////////////////////////// Content ////////////////////////////
+
+static const char* type_names[NTYPES]={"untyped", "text", "binary",
+  "random"};
+
+const char* typeName(int t) {
+  return type_names[t];
+}
+
+int chunkType(const U8* buf, size_t n) {
+  if (n==0)
+    return UNTYPED;
+  U32 t[256]={0};
+  for (size_t i=0; i<n; ++i)
+    ++t[buf[i]];
+
+  // Order 0 entropy, corrected as in entropyEstimate()
+  double h=n*log2(double(n));
+  int k=0;
+  for (int c=0; c<256; ++c)
+    if (t[c]) {
+      h-=t[c]*log2(double(t[c]));
+      ++k;
+    }
+  h+=(k-1)*0.5/log(2.0);
+  if (h/n>storebits)
+    return RANDOM;
+  size_t text=t[9]+t[10]+t[13];
+  for (int c=32; c<127; ++c)
+    text+=t[c];
+  return t[0]==0 && text*10>=n*9 ? TEXT : BINARY;
+}
+
+void scanContent(const ArchiveHeader& h, vector<ContentRun>& run) {
+
+  // Find the runs of chunks of the same type
+  vector<ContentRun> r;
+  U64 total=0;
+  for (int i=0; i<int(h.file.size()); ++i)
+    total=max(total, U64(h.file[i].offset+h.file[i].size));
+  vector<U8> buf(TYPECHUNK*256);
+  for (U64 u=0; u<total; u+=buf.size()) {
+    const size_t n=size_t(min(U64(buf.size()), total-u));
+    const size_t k=readFiles(h, u, &buf[0], n);
+    fill(buf.begin()+k, buf.begin()+n, 0);
+    for (size_t i=0; i<n; i+=TYPECHUNK) {
+      const size_t len=min(size_t(TYPECHUNK), n-i);
+      const int t=chunkType(&buf[i], len);
+      if (r.size()>0 && r.back().type==t)
+        r.back().size+=len;
+      else {
+        ContentRun cr={u+i, len, t};
+        r.push_back(cr);
+      }
+    }
+  }
+
+  // Join each short run to the one before, and then runs of the same
+  // type.  A short first run is joined to the one after.
+  const size_t first=run.size();
+  for (size_t i=0; i<r.size(); ++i) {
+    if (run.size()>first && (r[i].size<MINRUN
+        || r[i].type==run.back().type))
+      run.back().size+=r[i].size;
+    else if (run.size()==first+1 && run.back().size<MINRUN) {
+      run.back().size+=r[i].size;
+      run.back().type=r[i].type;
+    }
+    else
+      run.push_back(r[i]);
+  }
+}
+
+//////////////////////////// BlockWriter ////////////////////////////
+
+// Most bytes any block is primed with
+static U32 maxPrime(const vector<ArchiveBlock>& block) {
+  U32 n=0;
+  for (int i=0; i<int(block.size()); ++i)
+    n=max(n, block[i].prime);
+  return n;
+}
+
+// Append buf[0..n-1] to history, keeping at least the last hmax bytes
+static void keep(vector<U8>& history, U32 hmax, const U8* buf, size_t n) {
+  if (hmax==0)
+    return;
+  history.insert(history.end(), buf, buf+n);
+  if (history.size()>2*size_t(hmax)+(1<<16))
+    history.erase(history.begin(), history.end()-hmax);
+}
+
+BlockWriter::BlockWriter(FILE* f, ArchiveHeader& h): archive(f),
+    block(h.block), e(0), raw(0), b(-1), left(0), crc(0),
+    hmax(maxPrime(h.block)), in(0), start(ftell64(f)),
+    start_time(clock()), total_in(0), total_time(0) {}
+
+long BlockWriter::tell() const {
+  if (e) return e->tell();
+  if (raw) return raw->tell();
+  return ftell64(archive);
+}
+
+void BlockWriter::end() {
+  if (b<0)
+    return;
+  delete e;
+  delete raw;
+  e=0;
+  raw=0;
+  block[b].csize=ftell64(archive)-block[b].offset;
+  block[b].crc=crc;
+  crc=0;
+}
+
+void BlockWriter::next() {
+  end();
+  if (++b>=int(block.size())) {
+    printf("More data than blocks\n");
+    exit(1);
+  }
+  block[b].offset=ftell64(archive);
+  left=block[b].usize;
+  if (block[b].coder==STORED)
+    raw=new Writer(archive);
+  else {
+    e=new Encoder(COMPRESS, archive, Coder(block[b].coder), block[b].model,
+      block[b].mixer, block[b].apm);
+    const U32 p=block[b].prime;
+    if (p>0)
+      e->prime(&history[history.size()-p], p);
+  }
+}
+
+void BlockWriter::write(const U8* buf, size_t n) {
+  while (n>0) {
+    while (left==0) next();
+    const size_t k=size_t(min(U64(min(n, size_t(WINDOW))), left));
+    crc=crc32c(crc, buf, k);
+    keep(history, hmax, buf, k);
+    if (raw)
+      raw->write(buf, k);
+    else
+      e->encodeBytes(buf, k);
+    buf+=k;
+    n-=k;
+    left-=k;
+    in+=k;
+  }
+}
+
+void BlockWriter::print() {
+  const int now=clock();
+  const long pos=tell();
+  if (in>0)
+    printf("%ld/%ld = %6.4f bpc (%4.2f%%) in %1.2f sec\n",
+      pos-start, long(in), (pos-start)*8.0/in, (pos-start)*100.0/in,
+      double(now-start_time)/CLOCKS_PER_SEC);
+  else
+    printf("0 bytes\n");
+  total_in+=in;
+  total_time+=now-start_time;
+  in=0;
+  start=pos;
+  start_time=now;
+}
+
+void BlockWriter::close() {
+  end();
+  b=-1;
+  if (total_in>0) {
+    const long total=ftell64(archive);
+    printf("%ld/%ld = %6.4f bpc (%4.2f%%) in %1.2f sec\n",
+      total, long(total_in), total*8.0/total_in, total*100.0/total_in,
+      double(total_time)/CLOCKS_PER_SEC);
+    total_in=0;
+  }
+}
+
+///////////////////////// compressBlocks /////////////////////////
+
+#ifdef THREADS
+
+// Print the NUMA nodes of the pages of the models of e, which coded
+// block b on the given CPU
+static void reportNodes(int b, int cpu, Encoder& e) {
+  const void* p[PredictorBase::MAXMODELS*Model::MAXTABLES];
+  size_t n[PredictorBase::MAXMODELS*Model::MAXTABLES];
+  size_t count[MAXNODES]={0};
+  size_t other=0;
+  const int k=e.memory(p, n);
+  for (int i=0; i<k; ++i)
+    other+=pageNodes(p[i], n[i], count);
+  printf("block %d: cpu %d, model pages", b, cpu);
+  for (int i=0; i<MAXNODES; ++i)
+    if (count[i])
+      printf(" node %d: %lu", i, (unsigned long)count[i]);
+  if (other || k==0)
+    printf(" other: %lu", (unsigned long)other);
+  printf("\n");
+}
+
+class BlockScheduler;
+ThreadReturn scheduleThread(void* arg);
+
+// A worker's deque of block numbers.  The owner takes from the front
+// and other threads steal from the back.
+class BlockDeque {
+  Mutex mutex;
+  deque<int> q;
+public:
+  BlockDeque() {init_mutex(mutex);}
+  ~BlockDeque() {destroy_mutex(mutex);}
+  void push(int b) {q.push_back(b);}  // Before the threads start
+  bool take(int& b) {return get(b, true);}
+  bool steal(int& b) {return get(b, false);}
+  bool get(int& b, bool front) {
+    lock(mutex);
+    const bool ok=!q.empty();
+    if (ok) {
+      b=front ? q.front() : q.back();
+      if (front) q.pop_front(); else q.pop_back();
+    }
+    release(mutex);
+    return ok;
+  }
+};
+
+class BlockScheduler {
+public:
+  FILE* archive;
+  ArchiveHeader& h;
+  const int threads;
+  BlockDeque* work;           // One per thread
+  vector<vector<Piece> > pieces;  // Of each block
+  Mutex mutex;                // Protects the rest and writing archive
+  int next;                   // Worker number of the next thread
+  S64 pos;                    // End of archive
+  int steals;                 // Blocks stolen
+  vector<vector<U8> > done;   // Compressed blocks waiting to be written
+  vector<bool> finished;      // Of each block, whether it is in done
+  int written;                // Blocks written to archive
+  BlockScheduler(FILE* f, ArchiveHeader& hdr, int n): archive(f), h(hdr),
+      threads(n), work(new BlockDeque[n]), pieces(hdr.block.size()),
+      next(0), pos(ftell64(f)), steals(0), done(hdr.block.size()),
+      finished(hdr.block.size()), written(0) {
+    init_mutex(mutex);
+
+    // Deal the blocks round robin, so they finish about in the order
+    // they are written and each thread still reads its files in order
+    for (int b=0; b<int(h.block.size()); ++b)
+      work[b%threads].push(b);
+  }
+  ~BlockScheduler() {delete[] work; destroy_mutex(mutex);}
+
+  // Get a block for worker i to do, or return false if none are left.
+  // Blocks are never added, so if all deques are empty the work is done.
+  bool get(int i, int& b) {
+    if (work[i].take(b))
+      return true;
+    for (int j=1; j<threads; ++j) {
+      if (work[(i+j)%threads].steal(b)) {
+        lock(mutex);
+        ++steals;
+        release(mutex);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Take compressed block b from out.  Append the blocks that are then
+  // next in order to the archive.  Call with mutex locked.
+  void finish(int b, vector<U8>& out) {
+    done[b].swap(out);
+    finished[b]=true;
+    for (; written<int(h.block.size()) && finished[written]; ++written) {
+      ArchiveBlock& bk=h.block[written];
+      vector<U8>& v=done[written];
+      bk.offset=pos;
+      bk.csize=v.size();
+      if (v.size()>0)
+        fwrite(&v[0], 1, v.size(), archive);
+      pos+=v.size();
+      printf("block %d: %lld -> %lld\n", written, (long long)bk.usize,
+        (long long)bk.csize);
+      vector<U8>().swap(v);
+    }
+  }
+};
+
+// Compress blocks until none are left, up to interleave at a time
+ThreadReturn scheduleThread(void* arg) {
+  BlockScheduler& s=*(BlockScheduler*)arg;
+  lock(s.mutex);
+  const int id=s.next++;
+  release(s.mutex);
+  const int cpu=pinthreads ? pinThread(id) : -1;
+  const int k=modelthreads ? 1 : interleave;
+  vector<vector<U8> > in(k), out(k);
+  vector<U8> primer;
+  vector<int> batch;
+  int b;
+  while (true) {
+    batch.clear();
+    while (int(batch.size())<k && s.get(id, b))
+      batch.push_back(b);
+    if (batch.empty())
+      break;
+
+    // Read the blocks.  A missing or short file reads as zeros.
+    for (int j=0; j<int(batch.size()); ++j) {
+      ArchiveBlock& bk=s.h.block[batch[j]];
+      in[j].resize(bk.usize);
+      const size_t n=bk.usize ? readFiles(s.h, bk.uoffset, &in[j][0],
+        bk.usize, &s.pieces[batch[j]]) : 0;
+      fill(in[j].begin()+n, in[j].end(), 0);
+      bk.crc=crc32c(0, bk.usize ? &in[j][0] : 0, bk.usize);
+      out[j].clear();
+    }
+
+    // Compress them, interleaving those that are modeled
+    vector<Encoder*> e;
+    vector<int> eb;  // Block of each of e
+    vector<U8*> buf;
+    vector<size_t> len;
+    for (int j=0; j<int(batch.size()); ++j) {
+      const ArchiveBlock& bk=s.h.block[batch[j]];
+      if (bk.coder==STORED) {
+        out[j].swap(in[j]);
+        continue;
+      }
+
+      // Read the bytes before the block to prime with
+      primer.resize(bk.prime);
+      const size_t n=bk.prime ? readFiles(s.h, bk.uoffset-bk.prime,
+        &primer[0], bk.prime) : 0;
+      fill(primer.begin()+n, primer.end(), 0);
+      if (modelthreads)
+        Encoder::compressParallel(&in[j][0], in[j].size(), out[j],
+          Coder(bk.coder), bk.model, bk.mixer, bk.apm,
+          bk.prime ? &primer[0] : 0, bk.prime);
+      else {
+        e.push_back(new Encoder(out[j], Coder(bk.coder), bk.model,
+          bk.mixer, bk.apm));
+        eb.push_back(batch[j]);
+        if (bk.prime)
+          e.back()->prime(&primer[0], bk.prime);
+        buf.push_back(&in[j][0]);
+        len.push_back(in[j].size());
+      }
+    }
+    if (e.size()>0)
+      Encoder::codeInterleaved(&e[0], &buf[0], &len[0], e.size());
+    for (int j=0; j<int(e.size()); ++j) {
+      if (numareport) {
+        lock(s.mutex);
+        reportNodes(eb[j], cpu, *e[j]);
+        release(s.mutex);
+      }
+      delete e[j];  // Flushes out[j]
+    }
+
+    // Append them to the archive in order
+    lock(s.mutex);
+    for (int j=0; j<int(batch.size()); ++j)
+      s.finish(batch[j], out[j]);
+    release(s.mutex);
+  }
+  return 0;
+}
+
+bool compressBlocks(FILE* f, ArchiveHeader& h, int threads) {
+  const S64 start=ftell64(f);
+  S64 total_in=0;
+  {
+    BlockScheduler s(f, h, threads);
+    vector<ThreadID> tid(threads);
+    for (int i=0; i<threads; ++i)
+      run(tid[i], scheduleThread, &s);
+    for (int i=0; i<threads; ++i)
+      join(tid[i]);
+
+    // Combine the CRCs of the pieces of each file, in order
+    for (int i=0; i<int(h.file.size()); ++i)
+      h.file[i].crc=0;
+    for (int b=0; b<int(h.block.size()); ++b) {
+      total_in+=h.block[b].usize;
+      for (int j=0; j<int(s.pieces[b].size()); ++j) {
+        const Piece& p=s.pieces[b][j];
+        h.file[p.file].crc=crc32cCombine(h.file[p.file].crc, p.crc, p.len);
+      }
+    }
+    if (s.steals>0)
+      printf("%d blocks stolen\n", s.steals);
+  }
+  const S64 total=ftell64(f);
+  if (total_in>0)
+    printf("%lld/%lld = %6.4f bpc (%4.2f%%) in %d threads\n",
+      (long long)(total-start), (long long)total_in,
+      (total-start)*8.0/total_in, (total-start)*100.0/total_in, threads);
+  return true;
+}
+
+#else
+bool compressBlocks(FILE* f, ArchiveHeader& h, int threads) {
+  return false;
+}
+#endif
+
+////////////////////////// DecompressJob //////////////////////////
+
+/* A DecompressJob decodes blocks on a pool of threads into a reorder
+buffer of qsize slots, where block b goes in slot b mod qsize.  A
+decompressThread waits for interleave free slots, claims the next
+interleave blocks, reads their compressed data from the archive (one
+thread at a time), decodes them together and checks their CRCs.  The
+BlockReader takes the blocks in order with next(), which frees the slot
+of the previous block.
+*/
+
+#ifdef THREADS
+
+class DecompressJob;
+ThreadReturn decompressThread(void* arg);
+
+// Reorder buffer element
+struct DJ {
+  enum {OK, CRCERROR, TRUNCATED};
+  vector<U8> out;        // Decoded block
+  int status;
+  Semaphore ready;       // 1 when out holds the block
+  DJ(): status(OK) {}
+};
+
+class DecompressJob {
+public:
+  Mutex mutex;           // Protects claimed and reading the archive
+private:
+  FILE* archive;
+  const vector<ArchiveBlock>& block;
+  DJ* q;                 // Reorder buffer
+  unsigned qsize;        // Number of elements in q
+  int claimed;           // Next block to decode
+  int started;           // decompressThreads started
+  int current;           // Block returned by next(), or -1
+  Semaphore free;        // Number of free slots in q
+  vector<ThreadID> tid;  // decompressThreads
+public:
+  friend ThreadReturn decompressThread(void* arg);
+  DecompressJob(int threads, FILE* f, const ArchiveHeader& h);
+  const U8* next(int b);  // Wait for block b and return it
+  ~DecompressJob();       // Stop the threads
+};
+
+DecompressJob::DecompressJob(int threads, FILE* f, const ArchiveHeader& h):
+    archive(f), block(h.block), q(0),
+    qsize(threads*interleave+1),
+    claimed(0), started(0), current(-1), tid(threads) {
+  q=new DJ[qsize];
+  init_mutex(mutex);
+  free.init(qsize);
+  for (unsigned i=0; i<qsize; ++i)
+    q[i].ready.init(0);
+  for (int i=0; i<threads; ++i)
+    run(tid[i], decompressThread, this);
+}
+
+DecompressJob::~DecompressJob() {
+  lock(mutex);
+  claimed=block.size();
+  release(mutex);
+  for (unsigned i=0; i<tid.size()*interleave; ++i)
+    free.signal();
+  for (unsigned i=0; i<tid.size(); ++i)
+    join(tid[i]);
+  for (int i=qsize-1; i>=0; --i)
+    q[i].ready.destroy();
+  free.destroy();
+  destroy_mutex(mutex);
+  delete[] q;
+}
+
+const U8* DecompressJob::next(int b) {
+  if (current>=0)
+    free.signal();
+  current=b;
+  DJ& dj=q[b%qsize];
+  dj.ready.wait();
+  if (dj.status==DJ::CRCERROR) {
+    printf("Archive corrupted: CRC error in block %d\n", b);
+    exit(1);
+  }
+  if (dj.status==DJ::TRUNCATED) {
+    printf("Premature end of archive\n");
+    exit(1);
+  }
+  return dj.out.size() ? &dj.out[0] : 0;
+}
+
+// Decode blocks until there are none left, up to interleave at a time
+ThreadReturn decompressThread(void* arg) {
+  DecompressJob& job=*(DecompressJob*)arg;
+  lock(job.mutex);
+  const int id=job.started++;
+  release(job.mutex);
+  const int cpu=pinthreads ? pinThread(id) : -1;
+  const int k=interleave;
+  vector<vector<U8> > in(k);  // Compressed blocks
+  vector<size_t> n(k);        // Bytes read of each
+  vector<int> batch;
+  while (true) {
+    for (int j=0; j<k; ++j)
+      job.free.wait();
+
+    // Claim the next k blocks and read them
+    batch.clear();
+    lock(job.mutex);
+    while (int(batch.size())<k && job.claimed<int(job.block.size())) {
+      const int b=job.claimed++;
+      const int j=batch.size();
+      batch.push_back(b);
+      in[j].resize(job.block[b].csize);
+      fseek64(job.archive, job.block[b].offset, SEEK_SET);
+      n[j]=in[j].size() ? fread(&in[j][0], 1, in[j].size(), job.archive) : 0;
+    }
+    release(job.mutex);
+    for (int j=batch.size(); j<k; ++j)
+      job.free.signal();  // Let the other threads see the end too
+    if (batch.empty())
+      return 0;
+
+    // Decode into the slots of the blocks, interleaving those modeled
+    vector<Encoder*> e;
+    vector<int> eb;  // Block of each of e
+    vector<U8*> buf;
+    vector<size_t> len;
+    for (int j=0; j<int(batch.size()); ++j) {
+      const ArchiveBlock& bk=job.block[batch[j]];
+      DJ& dj=job.q[batch[j]%job.qsize];
+      dj.status=DJ::OK;
+      if (n[j]<in[j].size())
+        dj.status=DJ::TRUNCATED;
+      else if (bk.coder==STORED)
+        dj.out.swap(in[j]);
+      else {
+        dj.out.resize(bk.usize);
+        e.push_back(new Encoder(in[j].size() ? &in[j][0] : 0, in[j].size(),
+          Coder(bk.coder), bk.model, bk.mixer, bk.apm));
+        eb.push_back(batch[j]);
+        buf.push_back(dj.out.size() ? &dj.out[0] : 0);
+        len.push_back(dj.out.size());
+      }
+    }
+    if (e.size()>0)
+      Encoder::codeInterleaved(&e[0], &buf[0], &len[0], e.size());
+    for (int j=0; j<int(e.size()); ++j) {
+      if (numareport) {
+        lock(job.mutex);
+        reportNodes(eb[j], cpu, *e[j]);
+        release(job.mutex);
+      }
+      delete e[j];
+    }
+    for (int j=0; j<int(batch.size()); ++j) {
+      const ArchiveBlock& bk=job.block[batch[j]];
+      DJ& dj=job.q[batch[j]%job.qsize];
+      if (dj.status==DJ::OK && (dj.out.size()!=bk.usize
+          || crc32c(0, dj.out.size() ? &dj.out[0] : 0, dj.out.size())
+          !=bk.crc))
+        dj.status=dj.out.size()<bk.usize ? DJ::TRUNCATED : DJ::CRCERROR;
+      dj.ready.signal();
+    }
+  }
+  return 0;
+}
+
+#else
+class DecompressJob {};
+#endif
+
+//////////////////////////// BlockReader ////////////////////////////
+
+BlockReader::BlockReader(FILE* f, const ArchiveHeader& h, int threads):
+    archive(f), block(h.block), e(0), raw(0), job(0), cur(0), b(0),
+    left(0), crc(0), hmax(maxPrime(h.block)) {
+#ifdef THREADS
+  bool sized=block.size()>1 && hmax==0;  // Primed blocks go in order
+  for (int i=0; i<int(block.size()); ++i)
+    if (block[i].csize==0 && block[i].usize>0)  // Stream: unknown
+      sized=false;
+  if ((threads>1 || interleave>1) && sized)
+    job=new DecompressJob(threads, f, h);
+#endif
+}
+
+BlockReader::~BlockReader() {
+  delete e;
+  delete raw;
+#ifdef THREADS
+  delete job;
+#endif
+}
+
+void BlockReader::next() {
+  delete e;
+  delete raw;
+  e=0;
+  raw=0;
+  if (b>=int(block.size()))
+    truncated();
+  left=block[b].usize;
+  crc=0;
+#ifdef THREADS
+  if (job) {
+    cur=job->next(b++);
+    return;
+  }
+#endif
+
+  // Seek to the block, since blocks may be in any order and the
+  // Encoder or Reader of the previous block reads ahead
+  fseek64(archive, block[b].offset, SEEK_SET);
+  if (block[b].coder==STORED)
+    raw=new Reader(archive);
+  else {
+    e=new Encoder(DECOMPRESS, archive, Coder(block[b].coder), block[b].model,
+      block[b].mixer, block[b].apm);
+    const U32 p=block[b].prime;
+    if (p>history.size())
+      truncated();
+    if (p>0)
+      e->prime(&history[history.size()-p], p);
+  }
+  ++b;
+}
+
+void BlockReader::read(U8* buf, size_t n) {
+  while (n>0) {
+    while (left==0) next();
+    const size_t k=left<n ? size_t(left) : n;
+    if (job) {  // Decoded and checked
+      memcpy(buf, cur, k);
+      cur+=k;
+      buf+=k;
+      n-=k;
+      left-=k;
+      continue;
+    }
+    if (raw) {
+      if (raw->read(buf, k)<k)
+        truncated();
+    }
+    else
+      for (size_t i=0; i<k; ++i)
+        buf[i]=e->decodeByte();
+    crc=crc32c(crc, buf, k);
+    keep(history, hmax, buf, k);
+    buf+=k;
+    n-=k;
+    left-=k;
+    if (left==0 && crc!=block[b-1].crc) {
+      printf("Archive corrupted: CRC error in block %d\n", b-1);
+      exit(1);
+    }
+  }
+}
+
+void BlockReader::truncated() {
+  printf("Premature end of archive\n");
+  exit(1);
+}
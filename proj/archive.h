@@ -0,0 +1,255 @@
+#ifndef _ARCHIVE_
+#define _ARCHIVE_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "models/utils/datatypes.h"
+#include "encoder.h"
+
+using namespace std;
+
+/* Archive format.  An archive starts with a binary header, all numbers
+   MSB first:
+
+     "PAQB" 4 byte magic
+     U8     format version (6)
+     U32    number of files
+     U32    number of blocks
+     for each file:
+       U64  size in bytes
+       U64  offset of the file in the concatenation of all files
+       U32  CRC-32C of the file
+       U16  length of the name, followed by the name
+     for each block:
+       U64  offset of the compressed block in the archive
+       U64  compressed size
+       U64  offset of the block in the concatenation of all files
+       U64  uncompressed size
+       U32  CRC-32C of the uncompressed block
+       U32  bytes before the block that prime its model
+       U8   Coder
+       U8   ModelConfig of the Predictor (see encoder.h)
+       U8   BlockType of the content
+       U8   mixer contexts of the Predictor (MixerContext bits)
+       U8   APM contexts of the Predictor (APMContext bits)
+
+   Version 5 is the same without the APM contexts, which are then none.
+   Versions 1 to 4 are rejected with an error.  Their blocks were coded
+   by Predictors this version does not have, and version 4 was written
+   both with and without the Mixer, so they cannot be decoded.
+
+   The blocks follow.  The concatenation of all files is split into
+   blocks, and each block is coded by its own Encoder with a new
+   Predictor, so it can be decoded without decoding any other block.
+   Except that if prime > 0, the Predictor is first primed (see
+   Encoder::prime()) with the prime bytes of the concatenation before
+   the block, so that it does not start cold.  Such a block can only be
+   decoded after the bytes before it.
+   A block whose coder is STORED holds the uncompressed bytes.
+   A tool can list the archive or seek to the block holding any part
+   of any file from the header alone.
+
+   A stream archive (option -p) has a text header instead: a coder tag
+   line ("PAQ1\r\n"), then "stream crc32c model M mixer X apm A\r\n",
+   ended by "\032\f\0".  M, X and A name the ModelConfig, mixer
+   contexts and APM contexts of the Predictor, as -l prints them.  It
+   is read as a single block of unknown size starting after the
+   header.  The CRC-32C of the stream is coded as 4 bytes, MSB first,
+   after the end of stream marker (see main.cpp).
+   Older text headers, a file list or a stream line without the
+   Predictor, are rejected with an error, since the Predictor they
+   were coded with is not known.
+
+   ArchiveHeader h has the members:
+     file[i] with .name, .size, .offset, .crc
+     block[i] with .offset, .csize, .uoffset, .usize, .crc, .prime,
+       .coder, .model, .type, .mixer, .apm
+     stream, true if a stream archive (option -p), which has no files
+       and one block of unknown size
+   h.write(f) writes the binary header to f.  Its length depends only
+   on the number of files and blocks and the names, so it can be
+   rewritten in place once the block offsets are known.
+   h.read(f) reads a binary or text header from f, positioned at the
+   start of the archive, and returns false if it is not an archive.
+   h.list() prints the files and blocks.
+
+   BlockWriter w(f, h) codes the concatenation of the files in h to
+   archive f as the blocks of h.block, whose uoffset, usize, prime,
+   coder, model, mixer and apm must be set, and fills in their offset,
+   csize and crc.  It keeps the last bytes written for priming.
+   w.write(buf, n) compresses the n bytes in buf, WINDOW at a time, so
+   that each window is still in cache when it is coded after its CRC.
+   w.print() prints compression statistics since the last call.
+   w.close() ends the last block.  Called by the destructor.
+
+   compressBlocks(f, h, threads) does the same as writing all files to
+   a BlockWriter, using threads threads, and also fills in the CRCs of
+   the files.  Each block is a task, which reads its part of the files,
+   compresses it in memory and appends it to f.  Blocks are written in
+   index order, so the archive does not depend on the number of threads
+   or on which finishes first.  A block that finishes before those
+   ahead of it waits in memory, compressed.  The blocks are dealt round
+   robin to one deque per thread, so they finish about in order.  A
+   thread takes blocks from the front of its own deque, and when that
+   is empty it steals from the back of another, so no thread is idle
+   while blocks are left.  Memory use is about 2 blocks per thread,
+   plus the compressed blocks waiting.
+   If modelthreads is true then each block is compressed with
+   Encoder::compressParallel(), which adds a thread per model.
+   Otherwise each thread takes up to interleave blocks at a time and
+   codes them together with Encoder::codeInterleaved(), which hides
+   the latency of the models' hash table lookups.
+   If pinthreads is true then thread i is pinned to CPU i with
+   pinThread() (see thread.h) before it creates any Encoder, so the
+   tables of its models are allocated and first touched on its own
+   NUMA node.  The DecompressJob does the same.  If numareport is true
+   then the nodes of the pages of the models are printed after each
+   block, for both.
+   Returns false if THREADS is not defined.
+
+   probeBlocks(h) reads a sample of PROBE bytes of each block of h, in
+   8 pieces spread over the block, from the files of h, and changes the
+   coder of the block to STORED if entropyEstimate() of the sample
+   exceeds storebits bits per byte.  It is cheap compared to modeling.
+   A STORED block is not primed.
+
+   BlockReader r(f, h, threads) decodes the blocks of h from archive f
+   in order.
+     If threads > 1 or interleave > 1 (and THREADS is defined) and h
+     has more than one block of known size, none of them primed, then
+     a DecompressJob decodes
+     up to threads * interleave blocks at once into memory, each thread
+     interleaving its blocks, and r returns them in order.  It holds
+     at most threads * interleave + 1 decoded blocks, and the compressed
+     data of the blocks being decoded.
+   r.read(buf, n) decompresses the next n bytes to buf.  STORED data
+     is copied in bulk.  When the last byte of a block is decoded its
+     CRC is checked, and a mismatch ends the program with an error.
+
+   scanContent(h, run) reads the concatenation of the files of h once
+   and appends to run the runs of similar content, in order, covering
+   all of it.  Each TYPECHUNK bytes are classified by chunkType() and
+   consecutive chunks of the same type form a run.  A run shorter than
+   MINRUN bytes is joined to the run before it, so blocks cut at the
+   runs are not tiny.  This finds for example the boundaries between
+   text and binary files in a tar, or between the code and the
+   compressed resources of an executable.  The type of a block is
+   recorded so that a model can be chosen for it.
+   chunkType(buf, n) returns RANDOM if the order 0 entropy of buf[0..n-1]
+   exceeds storebits bits per byte, else TEXT if it has no NUL and at
+   least 90% printable ASCII, tabs and line breaks, else BINARY.  The
+   order 0 entropy is corrected for sample size as in entropyEstimate(),
+   which is too biased on a chunk to use itself.
+   typeName(t) returns the name of BlockType t.
+
+   entropyEstimate(buf, n) estimates the bits per byte needed to code
+   buf[0..n-1] as the lesser of its order 0 entropy and its entropy
+   given the high 4 bits of the previous byte.  Each is corrected for
+   the bias of a small sample by adding (k-1)/(2 ln 2) bits for each
+   context, where k is the number of distinct bytes seen in it.  A full
+   order 1 context has too few samples in PROBE bytes to estimate.
+*/
+
+enum {PROBE=1<<16};  // Bytes sampled per block
+enum {WINDOW=1<<18};  // Bytes CRC'd and then coded at once
+enum BlockType {UNTYPED, TEXT, BINARY, RANDOM, NTYPES};
+extern double storebits;
+extern bool modelthreads;
+extern int interleave;
+extern bool pinthreads, numareport;
+double entropyEstimate(const U8* buf, size_t n);
+
+struct ArchiveFile {
+  string name;
+  S64 size;    // Bytes
+  S64 offset;  // In the concatenation of all files
+  U32 crc;     // CRC-32C
+};
+
+struct ArchiveBlock {
+  U64 offset, csize;    // Compressed offset in archive and size
+  U64 uoffset, usize;   // Uncompressed offset and size
+  U32 crc;              // CRC-32C of the uncompressed data
+  U32 prime;            // Bytes before uoffset that prime the model
+  int coder;            // Coder
+  int model;            // ModelConfig
+  int type;             // BlockType
+  int mixer;            // Mixer contexts
+  int apm;              // APM contexts
+};
+
+class ArchiveHeader {
+public:
+  vector<ArchiveFile> file;
+  vector<ArchiveBlock> block;
+  bool stream;
+  ArchiveHeader(): stream(false) {}
+  void write(FILE* f) const;
+  bool read(FILE* f);
+  void list() const;
+};
+
+void probeBlocks(ArchiveHeader& h);
+
+struct ContentRun {
+  U64 offset, size;  // In the concatenation of all files
+  int type;          // BlockType
+};
+
+enum {TYPECHUNK=1<<12, MINRUN=1<<16};  // Bytes classified at once, least run
+void scanContent(const ArchiveHeader& h, vector<ContentRun>& run);
+int chunkType(const U8* buf, size_t n);
+const char* typeName(int t);
+
+class BlockWriter {
+  FILE* archive;
+  vector<ArchiveBlock>& block;
+  Encoder* e;       // Encoder of the current block, or 0
+  Writer* raw;      // Output of the current STORED block, or 0
+  int b;            // Index of the current block
+  U64 left;         // Bytes left in block b
+  U32 crc;          // CRC-32C of block b so far
+  vector<U8> history;  // At least the last hmax bytes written
+  U32 hmax;         // Most bytes any block is primed with
+  U64 in;           // Bytes compressed since print()
+  long start;       // Archive position at print()
+  int start_time;   // Clock at print()
+  U64 total_in;     // Bytes compressed
+  int total_time;   // Clocks
+  long tell() const;  // Current archive position
+  void next();      // End block b and start the next
+  void end();       // End block b
+public:
+  BlockWriter(FILE* f, ArchiveHeader& h);
+  void write(const U8* buf, size_t n);
+  void print();
+  void close();
+  ~BlockWriter() {close();}
+};
+
+bool compressBlocks(FILE* f, ArchiveHeader& h, int threads);
+
+class DecompressJob;  // Defined in archive.cpp
+
+class BlockReader {
+  FILE* archive;
+  const vector<ArchiveBlock>& block;
+  Encoder* e;       // Encoder of the current block, or 0
+  Reader* raw;      // Input of the current STORED block, or 0
+  DecompressJob* job;  // Decodes blocks in other threads, or 0
+  const U8* cur;    // With job, the rest of the current block
+  int b;            // Index of the next block
+  U64 left;         // Bytes left in the current block
+  U32 crc;          // CRC-32C of the current block so far
+  vector<U8> history;  // At least the last hmax bytes read
+  U32 hmax;         // Most bytes any block is primed with
+  void next();      // Start block b
+  void truncated(); // Fail on end of archive
+public:
+  BlockReader(FILE* f, const ArchiveHeader& h, int threads=1);
+  void read(U8* buf, size_t n);
+  ~BlockReader();
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include <cstring>
+#include "crc.h"
+
+#if !defined(NOSSE42) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+// Portable version.  crctab[0][c] is the CRC of byte c, crctab[k][c]
+// of byte c followed by k zero bytes.
+static U32 crctab[8][256];
+
+static void initTable() {
+  for (int c=0; c<256; ++c) {
+    U32 r=c;
+    for (int i=0; i<8; ++i)
+      r=(r>>1)^(0x82F63B78&-(r&1));
+    crctab[0][c]=r;
+  }
+  for (int c=0; c<256; ++c)
+    for (int k=1; k<8; ++k)
+      crctab[k][c]=(crctab[k-1][c]>>8)^crctab[0][crctab[k-1][c]&255];
+}
+
+static U32 crc32cTable(U32 crc, const U8* p, size_t n) {
+  for (; n>0 && (size_t(p)&7); --n)
+    crc=(crc>>8)^crctab[0][(crc^*p++)&255];
+  for (; n>=8; n-=8, p+=8) {
+    const U32 a=crc^(p[0]|p[1]<<8|p[2]<<16|U32(p[3])<<24);
+    crc=crctab[7][a&255]^crctab[6][a>>8&255]^crctab[5][a>>16&255]
+      ^crctab[4][a>>24]^crctab[3][p[4]]^crctab[2][p[5]]^crctab[1][p[6]]
+      ^crctab[0][p[7]];
+  }
+  for (; n>0; --n)
+    crc=(crc>>8)^crctab[0][(crc^*p++)&255];
+  return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static U32 crc32cSSE42(U32 crc, const U8* p, size_t n) {
+  for (; n>0 && (size_t(p)&7); --n)
+    crc=_mm_crc32_u8(crc, *p++);
+#ifdef __x86_64__
+  U64 c=crc;
+  for (; n>=8; n-=8, p+=8) {
+    U64 w;
+    memcpy(&w, p, 8);
+    c=_mm_crc32_u64(c, w);
+  }
+  crc=U32(c);
+#endif
+  for (; n>=4; n-=4, p+=4) {
+    U32 w;
+    memcpy(&w, p, 4);
+    crc=_mm_crc32_u32(crc, w);
+  }
+  for (; n>0; --n)
+    crc=_mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+// Choose the implementation.  This runs before main(), so before any
+// threads are started.
+typedef U32 (*CRC32CImpl)(U32, const U8*, size_t);
+
+static CRC32CImpl crc32cInit() {
+#ifdef CRC32C_SSE42
+  if (__builtin_cpu_supports("sse4.2"))
+    return crc32cSSE42;
+#endif
+  initTable();
+  return crc32cTable;
+}
+
+static const CRC32CImpl crc32cImpl=crc32cInit();
+
+U32 crc32c(U32 crc, const U8* buf, size_t n) {
+  return ~crc32cImpl(~crc, buf, n);
+}
+
+bool crc32cHardware() {
+  return crc32cImpl!=crc32cTable;
+}
+
+// Multiply the 32x32 matrix over GF(2) mat by vector v, after zlib
+static U32 gf2Times(const U32* mat, U32 v) {
+  U32 r=0;
+  for (; v; v>>=1, ++mat)
+    if (v&1) r^=*mat;
+  return r;
+}
+
+// r = m*m
+static void gf2Square(U32* r, const U32* m) {
+  for (int i=0; i<32; ++i)
+    r[i]=gf2Times(m, m[i]);
+}
+
+U32 crc32cCombine(U32 a, U32 b, U64 n) {
+  if (n==0)
+    return a;
+
+  // odd is the operator for 1 zero bit, then even for 2, odd for 4...
+  U32 even[32], odd[32];
+  odd[0]=0x82F63B78;
+  for (int i=1; i<32; ++i)
+    odd[i]=1u<<(i-1);
+  gf2Square(even, odd);
+  gf2Square(odd, even);
+
+  // Apply n zero bytes to a
+  do {
+    gf2Square(even, odd);
+    if (n&1) a=gf2Times(even, a);
+    n>>=1;
+    if (!n) break;
+    gf2Square(odd, even);
+    if (n&1) a=gf2Times(odd, a);
+    n>>=1;
+  } while (n);
+  return a^b;
+}
@@ -0,0 +1,32 @@
+#ifndef _CRC_
+#define _CRC_
+
+#include <cstddef>
+#include "models/utils/datatypes.h"
+
+/* CRC-32C (Castagnoli, polynomial 0x1EDC6F41, reflected 0x82F63B78) as
+used by iSCSI and ext4.
+
+   crc32c(crc, buf, n) returns the CRC of the bytes buf[0..n-1] appended
+   to data whose CRC is crc.  The CRC of no data is 0, so the CRC of a
+   stream is computed by starting with 0 and passing each piece in turn.
+   crc32c(0, "123456789", 9) is 0xE3069283.
+
+   On x86 CPUs with SSE4.2 the crc32 instruction is used, 8 bytes at a
+   time.  Otherwise a portable table driven version processes 8 bytes
+   per step (slicing by 8).  Both give the same result.  The choice is
+   made at program start.  Compile with -DNOSSE42 to always use the
+   portable version.
+
+   crc32cHardware() returns true if the crc32 instruction is used.
+
+   crc32cCombine(a, b, n) returns the CRC of data with CRC a followed by
+   n bytes of data with CRC b, in O(log n) time, as zlib's
+   crc32_combine().  It lets pieces of a file be checked out of order.
+*/
+
+U32 crc32c(U32 crc, const U8* buf, size_t n);
+bool crc32cHardware();
+U32 crc32cCombine(U32 a, U32 b, U64 n);
+
+#endif
@@ -1,41 +1,167 @@
 #include "encoder.h"
+#include <cstring>
+#include "thread.h"
 
-// Constructor
-Encoder::Encoder(Mode m, FILE* f): predictor(), mode(m), archive(f), x1(0),
-    x2(0xffffffff), x(0), eofs(0), xchars(0), encodes(0), start_time(0),
-    total_encodes(0), total_time(0) {
+// Archive version tags and command line names of each Coder
+static const char* coder_tags[NCODERS]={"PAQ1", "PAQ2", "PAQR2", "PAQR4",
+  "PAQR8", "PAQ0"};
+static const char* coder_names[NCODERS]={"ac32", "ac64", "rans2", "rans4",
+  "rans8", "stored"};
+static const int coder_lanes[NCODERS]={0, 0, 2, 4, 8, 0};
+
+// The Predictor of each ModelConfig and its command line name
+template <class P> static PredictorBase* newPredictor(int mixers, int apms) {
+  return new P(mixers, apms);
+}
+
+static struct {
+  const char* name;
+  PredictorBase* (*create)(int mixers, int apms);
+} model_configs[NMODELCONFIGS]={
+  {"ppm", newPredictor<Predictor<NonstationaryPPM<8> > >},
+  {"ppm4", newPredictor<Predictor<NonstationaryPPM<4> > >},
+  {"none", newPredictor<Predictor<> >}};
+
+// Bytes ahead of the coder that encodeBytes() passes to the models,
+// 0 = none (option -a)
+int lookahead=8;
+
+const char* coderTag(Coder c) {
+  return coder_tags[c];
+}
+
+int coderOfTag(const string& s) {
+  for (int i=0; i<NCODERS; ++i)
+    if (s==coder_tags[i])
+      return i;
+  return -1;
+}
+
+const char* coderName(Coder c) {
+  return coder_names[c];
+}
+
+int coderOfName(const string& s) {
+  for (int i=0; i<NCODERS; ++i)
+    if (s==coder_names[i])
+      return i;
+  return -1;
+}
+
+const char* modelName(int m) {
+  return model_configs[m].name;
+}
+
+int modelOfName(const string& s) {
+  for (int i=0; i<NMODELCONFIGS; ++i)
+    if (s==model_configs[i].name)
+      return i;
+  return -1;
+}
+
+// Constructors
+Encoder::Encoder(Mode m, FILE* f, Coder c, int model, int mixers,
+    int apms): predictor(model_configs[model].create(mixers, apms)),
+    mode(m), coder(c),
+    archive(f), in(0), out(0), x1(0), x2(0xffffffff), x(0), z1(0),
+    z2(~U64(0)), z(0), lanes(coder_lanes[c]), rbit(0), rw(0), eofs(0),
+    xchars(0), encodes(0), start_time(0), total_encodes(0), total_time(0) {
+  if (mode==COMPRESS)
+    out=new Writer(archive);
+  else
+    in=new Reader(archive);
+  init();
+}
+
+Encoder::Encoder(vector<U8>& v, Coder c, int model, int mixers,
+    int apms): predictor(model_configs[model].create(mixers, apms)),
+    mode(COMPRESS), coder(c), archive(0), in(0), out(new Writer(v)), x1(0), x2(0xffffffff),
+    x(0), z1(0), z2(~U64(0)), z(0), lanes(coder_lanes[c]), rbit(0), rw(0),
+    eofs(0), xchars(0), encodes(0), start_time(0), total_encodes(0),
+    total_time(0) {
+  init();
+}
+
+Encoder::Encoder(const U8* data, size_t n, Coder c, int model,
+    int mixers, int apms):
+    predictor(model_configs[model].create(mixers, apms)),
+    mode(DECOMPRESS), coder(c), archive(0), in(new Reader(data, n)), out(0),
+    x1(0), x2(0xffffffff), x(0), z1(0), z2(~U64(0)), z(0),
+    lanes(coder_lanes[c]), rbit(0), rw(0), eofs(0), xchars(0), encodes(0),
+    start_time(0), total_encodes(0), total_time(0) {
+  init();
+}
+
+void Encoder::init() {
   start_time=clock();
+  if (lanes) {
+    rword.resize(RANSBLOCK);
+    if (mode==COMPRESS)
+      rsym.resize(RANSBLOCK);
+    else
+      rbit=RANSBLOCK;  // Load the first block on the first bit
+  }
 
-  // In DECOMPRESS mode, initialize x to the first 4 bytes of the archive
+  // In DECOMPRESS mode, initialize x to the first 4 bytes of the archive,
+  // or z to the first 8 bytes for AC64
   if (mode==DECOMPRESS) {
-    for (int i=0; i<4; ++i) {
-      int c=getc(archive);
-      if (c==EOF) {
-        c=0;
-        ++eofs;
-      }
-      else
-        ++xchars;
-      x=(x<<8)+c;
+    if (coder==AC64)
+      for (int i=0; i<8; ++i)
+        z=(z<<8)+get();
+    else if (coder==AC32)
+      for (int i=0; i<4; ++i)
+        x=(x<<8)+get();
+  }
+}
+
+// Return the next archive byte, or 0 at EOF.  Fail after too many EOFs.
+inline int Encoder::get() {
+  int c=in->get();
+  if (c==EOF) {
+    c=0;
+    if (++eofs>5) {
+      printf("Premature end of archive\n");
+      print();
+      exit(1);
     }
   }
+  else
+    ++xchars;
+  return c;
 }
 
 /* encode(bit) -- Split the range [x1, x2] at x in proportion to predictor
    P(y = 1).  In COMPRESS mode, make the lower or upper subrange
    the new range according to y.  In DECOMPRESS mode, return 0 or 1
    according to which subrange x is in, and make this the new range.
+   codeBit(y, pr) does this with the predictions of pr, the Predictor
+   by its type.
+*/
+int Encoder::encode(int y) {
+  return predictor->encode(*this, y);
+}
 
-   Maintain x1 <= x <= x2 as the last 4 bytes of compressed data:
+template <class P> int Encoder::codeBit(int y, P& pr) {
+  ++encodes;
+  const U32 p=65535-pr.p(); // Probability P(0) * 64K rounded down
+  if (coder==AC32)
+    y=code32(y, p, x1, x2, x);
+  else if (coder==AC64)
+    y=code64(y, p, z1, z2, z);
+  else
+    y=codeRans(y, p);
+  pr.update(y);
+  return y;
+}
+
+/* AC32: Maintain x1 <= x <= x2 as the last 4 bytes of compressed data:
    In COMPRESS mode, write the leading bytes of x2 that match x1.
    In DECOMPRESS mode, shift out these bytes and shift in an equal
    number of bytes into x from the archive.
 */
-int Encoder::encode(int y) {
-  ++encodes;
+inline int Encoder::code32(int y, U32 p, U32& x1, U32& x2, U32& x) {
 
   // Split the range
-  U32 p=65535-predictor.p(); // Probability P(0) * 64K rounded down
   const U32 xdiff=x2-x1;
   U32 xmid=x1;  // = x1+p*(x2-x1) multiply without overflow, round down
   if (xdiff>=0x10000000) xmid+=(xdiff>>16)*p;
@@ -61,53 +187,249 @@ int Encoder::encode(int y) {
       x1=xmid+1;
     }
   }
-  predictor.update(y);
 
   // Shift equal MSB's out
   while (((x1^x2)&0xff000000)==0) {
     if (mode==COMPRESS) {
-      putc(x2>>24, archive);
+      out->put(x2>>24);
       ++xchars;
     }
     x1<<=8;
     x2=(x2<<8)+255;
+    if (mode==DECOMPRESS)
+      x=(x<<8)+get();
+  }
+  return y;
+}
+
+/* AC64: Maintain z1 <= z <= z2 as the last 8 bytes of compressed data.
+   z2-z1 is at least 2^32 except when the range straddles a 32-bit
+   boundary, so (z2-z1)>>16 keeps at least 16 bits of precision and
+   the split needs a single multiply.  When the high 32 bits of z1
+   and z2 match, write them as one word (or shift in the next word).
+*/
+inline int Encoder::code64(int y, U32 p, U64& z1, U64& z2, U64& z) {
+  const U64 zmid=z1+((z2-z1)>>16)*p;  // z1 <= zmid < z2
+  if (mode==DECOMPRESS)
+    y=z>zmid;
+  if (y)
+    z1=zmid+1;
+  else
+    z2=zmid;
+
+  // Shift out equal high words
+  while (((z1^z2)>>32)==0) {
+    if (mode==COMPRESS) {
+      const U32 w=U32(z2>>32);
+      out->put(w>>24);
+      out->put(w>>16);
+      out->put(w>>8);
+      out->put(w);
+      xchars+=4;
+    }
+    z1<<=32;
+    z2=(z2<<32)|0xffffffff;
     if (mode==DECOMPRESS) {
-      int c=getc(archive);
-      if (c==EOF) {
-        c=0;
-        if (++eofs>5) {
-          printf("Premature end of archive\n");
-          print();
-          exit(1);
-        }
-      }
-      else
-        ++xchars;
-      x=(x<<8)+c;
+      U32 w=get();
+      w=(w<<8)|get();
+      w=(w<<8)|get();
+      w=(w<<8)|get();
+      z=(z<<32)|w;
+    }
+  }
+  return y;
+}
+
+/* codeByte(c) -- Code the 8 bits of c MSB first, or in DECOMPRESS mode
+   decode 8 bits, and return the byte.  The range is copied to locals
+   for the whole byte: writes through the archive buffer may alias any
+   member, so otherwise it would be reloaded from memory on every bit.
+   The last bit goes to Predictor::updateByte() and the rest to
+   updateBit(), so the models need not test for the end of a byte.
+   codeBits(c, pr) does the same with predictions from pr, which has
+   the p(), updateBit() and updateByte() methods of a Predictor.
+*/
+int Encoder::codeByte(int c) {
+  return predictor->codeByte(*this, c);
+}
+
+template <class P> int Encoder::codeBits(int c, P& pr) {
+  encodes+=8;
+  int d=0;  // Bits coded so far
+  if (coder==AC32) {
+    U32 a=x1, b=x2, v=x;
+    for (int i=7; i>0; --i) {
+      const int y=code32((c>>i)&1, 65535-pr.p(), a, b, v);
+      pr.updateBit(y);
+      d+=d+y;
+    }
+    const int y=code32(c&1, 65535-pr.p(), a, b, v);
+    pr.updateByte(y);
+    d+=d+y;
+    x1=a, x2=b, x=v;
+  }
+  else if (coder==AC64) {
+    U64 a=z1, b=z2, v=z;
+    for (int i=7; i>0; --i) {
+      const int y=code64((c>>i)&1, 65535-pr.p(), a, b, v);
+      pr.updateBit(y);
+      d+=d+y;
+    }
+    const int y=code64(c&1, 65535-pr.p(), a, b, v);
+    pr.updateByte(y);
+    d+=d+y;
+    z1=a, z2=b, z=v;
+  }
+  else {  // rANS states are per lane and block buffered
+    for (int i=7; i>0; --i) {
+      const int y=codeRans((c>>i)&1, 65535-pr.p());
+      pr.updateBit(y);
+      d+=d+y;
+    }
+    const int y=codeRans(c&1, 65535-pr.p());
+    pr.updateByte(y);
+    d+=d+y;
+  }
+  return d;
+}
+
+void Encoder::encodeBytes(const U8* buf, size_t n) {
+  predictor->encodeBytes(*this, buf, n);
+}
+
+template <class P> void Encoder::codeBytes(const U8* buf, size_t n, P& pr) {
+  size_t ahead=0;  // Bytes of buf passed to pr.lookahead()
+  for (size_t i=0; i<n; ++i) {
+    for (; ahead<n && ahead<i+lookahead; ++ahead)
+      pr.lookahead(buf[ahead]);
+    codeBits(buf[i], pr);
+  }
+}
+
+void Encoder::prime(const U8* buf, size_t n) {
+  predictor->prime(*this, buf, n);
+}
+
+template <class P> void Encoder::primeBits(const U8* buf, size_t n, P& pr) {
+  for (size_t i=0; i<n; ++i) {
+    const int c=buf[i];
+    for (int j=7; j>0; --j) {
+      pr.p();
+      pr.updateBit((c>>j)&1);
     }
+    pr.p();
+    pr.updateByte(c&1);
   }
+}
+
+/* rANS with 16-bit probabilities, 32-bit states in [2^16, 2^32) and
+   16-bit words.  Coding a bit with frequency f (of 64K) in state x
+   maps x to (x/f)*64K + x%f + cumulative frequency, writing the low
+   word of x first if the result would overflow.  Since f >= 1 a single
+   word of renormalization is always enough, so neither side loops.
+*/
+inline int Encoder::codeRans(int y, U32 p) {
+  const U32 f0=p ? p : 1;  // Frequency of a 0, 1..65535
+  if (mode==COMPRESS) {
+    rsym[rbit]=f0*2+y;
+    if (++rbit==RANSBLOCK)
+      flushRans();
+    return y;
+  }
+  if (rbit==RANSBLOCK)
+    loadRans();
+  U32& xr=r[rbit++%lanes];
+  const U32 s=xr&0xffff;
+  y=s>=f0;
+  if (y)
+    xr=(65536-f0)*(xr>>16)+s-f0;
+  else
+    xr=f0*(xr>>16)+s;
+  if (xr<0x10000)
+    xr=(xr<<16)|*rw++;
   return y;
 }
 
+// Code the buffered bits last to first, then write the block
+void Encoder::flushRans() {
+  for (int i=0; i<lanes; ++i)
+    r[i]=0x10000;
+  U16* const end=&rword[0]+RANSBLOCK;
+  U16* w=end;
+  for (int k=rbit-1; k>=0; --k) {
+    U32& xr=r[k%lanes];
+    const U32 f0=rsym[k]>>1;
+    const U32 f=(rsym[k]&1) ? 65536-f0 : f0;
+    const U32 c=(rsym[k]&1) ? f0 : 0;
+    if (xr>=(f<<16)) {
+      *--w=xr;
+      xr>>=16;
+    }
+    xr=((xr/f)<<16)+xr%f+c;
+  }
+  const U32 n=end-w;
+  out->put(n>>24), out->put(n>>16), out->put(n>>8), out->put(n);
+  for (int i=0; i<lanes; ++i)
+    out->put(r[i]>>24), out->put(r[i]>>16), out->put(r[i]>>8), out->put(r[i]);
+  for (; w<end; ++w)
+    out->put(*w>>8), out->put(*w);
+  xchars+=4+lanes*4+n*2;
+  rbit=0;
+}
+
+// Read a block written by flushRans()
+void Encoder::loadRans() {
+  U32 n=0;
+  for (int i=0; i<4; ++i)
+    n=(n<<8)+get();
+  if (n>RANSBLOCK) {
+    printf("Bad rANS block in archive\n");
+    exit(1);
+  }
+  for (int i=0; i<lanes; ++i) {
+    r[i]=0;
+    for (int j=0; j<4; ++j)
+      r[i]=(r[i]<<8)+get();
+  }
+  for (U32 i=0; i<n; ++i) {
+    const int c=get();
+    rword[i]=(c<<8)+get();
+  }
+  rw=&rword[0];
+  rbit=0;
+}
+
 // Destructor
 Encoder::~Encoder() {
 
-  // In COMPRESS mode, write out the remaining bytes of x, x1 < x < x2
+  // In COMPRESS mode, write out all 4 bytes of x1 (8 bytes of z1 for
+  // AC64), or the last rANS block.  Then the decoder never shifts in
+  // bytes past the end, which may belong to the next block.
   if (mode==COMPRESS) {
-    while (((x1^x2)&0xff000000)==0) {
-      putc(x2>>24, archive);
-      x1<<=8;
-      x2=(x2<<8)+255;
+    if (lanes) {
+      if (rbit>0)
+        flushRans();
     }
-    putc(x2>>24, archive);  // First unequal byte
+    else if (coder==AC64) {
+      for (int i=56; i>=0; i-=8)
+        out->put(int(z1>>i)&255);
+    }
+    else {
+      for (int i=24; i>=0; i-=8)
+        out->put((x1>>i)&255);
+    }
+    out->flush();
   }
   if (total_encodes>0) {
-    long total_xchars=ftell(archive);
+    long total_xchars=out ? out->tell() : ftell(archive);
     printf("%ld/%ld = %6.4f bpc (%4.2f%%) in %1.2f sec\n",
       total_xchars, total_encodes/8,
       total_xchars*64.0/total_encodes, total_xchars*800.0/total_encodes,
       double(total_time)/CLOCKS_PER_SEC);
   }
+  delete in;
+  delete out;
+  delete predictor;
 }
 
 // Print Encoder stats
@@ -127,3 +449,210 @@ void Encoder::print() {
   xchars=0;
 }
 
+
+void Encoder::codeInterleaved(Encoder** e, U8** buf, const size_t* n,
+    int k) {
+  if (k==1) {  // Nothing to interleave, so code whole bytes
+    if (e[0]->mode==COMPRESS)
+      e[0]->encodeBytes(buf[0], n[0]);
+    else
+      for (size_t j=0; j<n[0]; ++j)
+        buf[0][j]=e[0]->decodeByte();
+    return;
+  }
+  size_t most=0;
+  vector<size_t> ahead(k);  // Bytes of each buf passed to lookahead()
+  for (int s=0; s<k; ++s)
+    most=max(most, n[s]);
+  for (size_t j=0; j<most; ++j) {
+    for (int s=0; s<k; ++s)
+      if (e[s]->mode==COMPRESS)
+        for (; ahead[s]<n[s] && ahead[s]<j+lookahead; ++ahead[s])
+          e[s]->predictor->lookahead(buf[s][ahead[s]]);
+    for (int i=7; i>=0; --i) {
+      for (int s=0; s<k; ++s) {
+        if (j>=n[s])
+          continue;
+        U8& c=buf[s][j];
+        if (e[s]->mode==COMPRESS)
+          e[s]->encode((c>>i)&1);
+        else
+          c=(i==7 ? 0 : c*2)+e[s]->encode();
+      }
+    }
+  }
+}
+
+///////////////////////// compressParallel /////////////////////////
+
+// Predictions from the inputs computed by the model threads, mixed by
+// the Predictor pr
+struct ModelInputs {
+  PredictorBase* pr;
+  int n;                                      // Number of models
+  const short* x[PredictorBase::MAXMODELS];   // Inputs of the next bit
+  int k[PredictorBase::MAXMODELS];            // Inputs per bit of each model
+  U16 p() {
+    short* t=pr->inputs();
+    int m=0;
+    for (int i=0; i<n; ++i) {
+      memcpy(t+m, x[i], k[i]*sizeof(short));
+      m+=k[i];
+    }
+    return pr->mix(m);
+  }
+  void updateBit(int y) {
+    pr->train(y);
+    for (int i=0; i<n; ++i)
+      x[i]+=k[i];
+  }
+  void updateByte(int y) {updateBit(y);}
+};
+
+// A model and the buffers of mixer inputs it passes to the coder
+struct ModelThread {
+  Model* model;
+  const U8* prime;        // Bytes to prime model with
+  size_t np;              // Bytes in prime
+  const U8* buf;          // Data
+  size_t n;               // Bytes in buf
+  Ring ring;              // Buffers filled
+  vector<short> x[4];     // 8 bits of inputs per byte per buffer
+  ModelThread(): ring(4) {}
+};
+
+// Run a model of type M over the data, storing its inputs of each bit
+template <class M> static void* modelThread(void* arg) {
+  ModelThread& t=*(ModelThread*)arg;
+  M& model=*static_cast<M*>(t.model);
+  pinThread(-1);  // Not to the CPU of the thread that started it
+  const int k=model.inputs();
+  const size_t n=t.np+t.n;  // The primer, then the data
+  size_t ahead=0;  // Bytes of buf passed to lookahead()
+  for (size_t i=0; i<n; ) {
+    int spins=0;
+    while (t.ring.full())
+      Ring::wait(spins);
+    vector<short>& x=t.x[t.ring.back()];
+    const size_t end=min(n, i+x.size()/(8*k));
+    for (short* p=&x[0]; i<end; ++i) {
+      for (; i>=t.np && ahead<t.n && ahead<i-t.np+lookahead; ++ahead)
+        model.lookahead(t.buf[ahead]);
+      const int c=i<t.np ? t.prime[i] : t.buf[i-t.np];
+      for (int j=7; j>=0; --j, p+=k) {
+        model.predict(p);
+        if (j)
+          model.updateBit((c>>j)&1);
+        else
+          model.updateByte(c&1);
+      }
+    }
+    t.ring.push();
+  }
+  t.ring.close();
+  return 0;
+}
+
+// Lists the models of a Predictor and their thread functions
+struct ModelList {
+  Model** m;
+  ModelLoop* loop;
+  int n;
+  template <class M> void operator()(M& model) {
+    m[n]=&model;
+    if (loop)
+      loop[n]=modelThread<M>;
+    ++n;
+  }
+};
+
+// The methods of each Predictor that code with it by its type
+template <class... Ms> int Predictor<Ms...>::models(Model** p,
+    ModelLoop* loop) {
+  ModelList list={p, loop, 0};
+  m.each(list);
+  return list.n;
+}
+
+template <class... Ms> int Predictor<Ms...>::encode(Encoder& e, int y) {
+  return e.codeBit(y, *this);
+}
+
+template <class... Ms> int Predictor<Ms...>::codeByte(Encoder& e, int c) {
+  return e.codeBits(c, *this);
+}
+
+template <class... Ms> void Predictor<Ms...>::encodeBytes(Encoder& e,
+    const U8* buf, size_t n) {
+  e.codeBytes(buf, n, *this);
+}
+
+template <class... Ms> void Predictor<Ms...>::prime(Encoder& e,
+    const U8* buf, size_t n) {
+  e.primeBits(buf, n, *this);
+}
+
+#ifdef THREADS
+
+void Encoder::compressParallel(const U8* buf, size_t n, vector<U8>& v,
+    Coder c, int model, int mixers, int apms, const U8* p, size_t np) {
+  Encoder e(v, c, model, mixers, apms);
+  Model* m[PredictorBase::MAXMODELS];
+  ModelLoop loop[PredictorBase::MAXMODELS];
+  ModelInputs mc;
+  mc.pr=e.predictor;
+  mc.n=e.predictor->models(m, loop);
+  if (mc.n==0) {
+    e.prime(p, np);
+    e.encodeBytes(buf, n);
+    return;
+  }
+
+  // Start a thread for each model of e's predictor, which e does not
+  // use itself
+  vector<ModelThread> t(mc.n);
+  vector<ThreadID> tid(mc.n);
+  for (int i=0; i<mc.n; ++i) {
+    t[i].model=m[i];
+    t[i].prime=p;
+    t[i].np=np;
+    t[i].buf=buf;
+    t[i].n=n;
+    mc.k[i]=m[i]->inputs();
+    for (int j=0; j<4; ++j)
+      t[i].x[j].resize(MODELWINDOW*8*mc.k[i]);
+    run(tid[i], loop[i], &t[i]);
+  }
+
+  // Code each buffer when all models have filled it.  The first np
+  // bytes only prime the mixer.
+  for (size_t i=0; i<np+n; i+=MODELWINDOW) {
+    for (int j=0; j<mc.n; ++j) {
+      int spins=0;
+      while (t[j].ring.empty())
+        Ring::wait(spins);
+      mc.x[j]=&t[j].x[t[j].ring.front()][0];
+    }
+    const size_t end=min(np+n, i+MODELWINDOW);
+    size_t k=i;
+    if (k<np) {
+      e.primeBits(p+k, min(end, np)-k, mc);
+      k=min(end, np);
+    }
+    for (; k<end; ++k)
+      e.codeBits(buf[k-np], mc);
+    for (int j=0; j<mc.n; ++j)
+      t[j].ring.pop();
+  }
+  for (int i=0; i<mc.n; ++i)
+    join(tid[i]);
+}
+
+#else
+void Encoder::compressParallel(const U8* buf, size_t n, vector<U8>& v,
+    Coder c, int model, int mixers, int apms, const U8* p, size_t np) {
+  Encoder e(v, c, model, mixers, apms);
+  e.prime(p, np);
+  e.encodeBytes(buf, n);
+}
+#endif
@@ -13,37 +13,173 @@
 #include <map>
 #include "models/utils/datatypes.h"
 #include "predictor.h"
+#include "io.h"
 
 using namespace std;
 
 /* An Encoder does arithmetic encoding.  Methods:
-   Encoder(COMPRESS, f) creates encoder for compression to archive f, which
-     must be open for writing in binary mode
-   Encoder(DECOMPRESS, f) creates encoder for decompression from archive f,
-     which must be open for reading in binary mode
+   Encoder(COMPRESS, f, c) creates encoder for compression to archive f,
+     which must be open for writing in binary mode, using coder c
+   Encoder(DECOMPRESS, f, c) creates encoder for decompression from archive
+     f, which must be open for reading in binary mode, using coder c
+   Encoder(v, c) creates encoder for compression to the end of
+     vector<U8> v, which grows as needed
+   Encoder(p, n, c) creates encoder for decompression of the n bytes
+     at p
+   Each takes optional last arguments, the ModelConfig of the
+   Predictor and its mixer and APM contexts (see predictor.h), PPM,
+   MIXDEFAULT and APMDEFAULT if not given.  The Predictor is made from
+   the list of configurations in encoder.cpp, and the Encoder codes
+   through it once per bit, byte or buffer (see PredictorBase), so the
+   models are called by their types on every bit.
+   Archive bytes go through a buffered Writer or Reader (io.h).  In
+   DECOMPRESS mode the archive is read ahead, so f should not be read
+   directly while the Encoder exists.
    encode(bit) in COMPRESS mode compresses bit to file f.
    encode() in DECOMPRESS mode returns the next decompressed bit from file f.
+   encodeByte(c) in COMPRESS mode compresses byte c, MSB first.
+   decodeByte() in DECOMPRESS mode returns the next decompressed byte.
+     These are equivalent to 8 calls to encode() but keep the coder state
+     in registers across the byte and tell the predictor which bit
+     completes the byte, so per-byte model work is done once.
+   encodeBytes(buf, n) in COMPRESS mode compresses buf[0..n-1].  Since
+     the bytes are known, each is passed to Predictor::lookahead()
+     lookahead bytes before it is coded, so the models can prefetch the
+     memory of the contexts they will need.  A stream coded by calls
+     to encodeBytes() alone codes each byte exactly once through
+     lookahead(), so the hint stays in step across calls.
+   prime(buf, n) runs the predictor over buf[0..n-1] as if coding it,
+     but codes nothing, so that the models and the mixer start warm.
+     The decoder must prime with the same bytes at the same point.
    print() prints compression statistics
+   tell() in COMPRESS mode returns the archive position, as ftell(f)
+   memory(p, n) gives the tables of the models (see Predictor::memory())
+   Encoder::compressParallel(buf, n, v, c, m, mc, ac, p, np) compresses
+     the n bytes at buf to the end of v with coder c, exactly as
+     prime(p, np) then encodeBytes(buf, n) of an Encoder(v, c, m, mc, ac)
+     would.  If THREADS is defined (see thread.h), each model of the
+     Predictor runs over buf in its own thread, writing its mixer inputs
+     for each bit to a Ring of buffers of MODELWINDOW bytes' worth,
+     while the calling thread mixes the inputs of all models and codes.
+     Only compression can do this, since the decoder needs each bit
+     before the models can predict the next.
+   Encoder::codeInterleaved(e, buf, n, k) codes k independent streams
+     on one thread, stream i being the n[i] bytes at buf[i] coded by
+     Encoder e[i].  In COMPRESS mode buf[i] is compressed, and in
+     DECOMPRESS mode it is decompressed into.  The streams take turns
+     one bit at a time, like coroutines that yield after each bit.
+     In COMPRESS mode each stream's bytes are passed to lookahead() as
+     in encodeBytes().
+     update() prefetches the counters of a model's next bit (see
+     NonstationaryPPM), so while one stream codes a bit the memory
+     for the other k-1 is being loaded.  Each stream is coded exactly
+     as it would be on its own.
+
+   The coder c selects the arithmetic coder, which determines the archive
+   format.  Each coder has its own archive version tag:
+   AC32 ("PAQ1") keeps a 32-bit range and writes one byte at a time.
+   AC64 ("PAQ2") keeps a 64-bit range, splits it with a single 32x32 bit
+     multiply per bit and writes 32-bit big-endian words.
+   RANS2, RANS4, RANS8 ("PAQR2", "PAQR4", "PAQR8") are binary rANS coders
+     with 2, 4 or 8 interleaved states.  Bit i is coded by state i mod n,
+     so the decoder's state updates are independent of each other.
+     rANS decodes in the reverse order of encoding, so the encoder
+     buffers RANSBLOCK bits with their probabilities and codes each
+     block backwards when it is full.  A block is stored as the number
+     of 16-bit words, the n final states and the words.
+   STORED ("PAQ0") means the data is not coded at all.  It is a block
+     type of the archive (see archive.h) rather than a coder: there is
+     no Encoder for STORED data.
+   coderTag(c) returns the tag of coder c.
+   coderOfTag(s) returns the coder with tag s, or -1 if none.
+   coderName(c) and coderOfName(s) do the same for the names used on
+     the command line ("ac32", "ac64", "rans2", "rans4", "rans8",
+     "stored").
+
+   The ModelConfig m selects the models of the Predictor, which also
+   determines the archive format.  Each is a Predictor type compiled
+   in, so a new one is added at the end of the list, and the numbers
+   of the others never change:
+   PPM ("ppm") is NonstationaryPPM<8>, contexts of up to 7 bytes.
+   PPM4 ("ppm4") is NonstationaryPPM<4>, which is faster and needs
+     less memory.
+   NOMODELS ("none") has no models: the mixer and the APMs alone.
+   modelName(m) returns the command line name of ModelConfig m.
+   modelOfName(s) returns the ModelConfig with name s, or -1 if none.
 */
 
 typedef enum {COMPRESS, DECOMPRESS} Mode;
+extern int lookahead;  // Bytes encodeBytes() looks ahead (option -a)
+typedef enum {AC32, AC64, RANS2, RANS4, RANS8, STORED, NCODERS} Coder;
+const char* coderTag(Coder c);
+int coderOfTag(const string& s);
+const char* coderName(Coder c);
+int coderOfName(const string& s);
+typedef enum {PPM, PPM4, NOMODELS, NMODELCONFIGS} ModelConfig;
+const char* modelName(int m);
+int modelOfName(const string& s);
+
 class Encoder {
 private:
-  Predictor predictor;
+  PredictorBase* predictor;  // Models of the ModelConfig, and mixer
   const Mode mode;       // Compress or decompress?
+  const Coder coder;     // Which arithmetic coder
   FILE* archive;         // Compressed data file
+  Reader* in;            // Buffered archive input in DECOMPRESS mode
+  Writer* out;           // Buffered archive output in COMPRESS mode
   U32 x1, x2;            // Range, initially [0, 1), scaled by 2^32
   U32 x;                 // Last 4 input bytes of archive.
+  U64 z1, z2;            // AC64 range, initially [0, 1), scaled by 2^64
+  U64 z;                 // AC64 last 8 input bytes of archive
+  enum {RANSBLOCK=1<<20};  // Bits per rANS block
+  enum {MODELWINDOW=1<<14};  // Bytes per buffer of compressParallel()
+  int lanes;             // Number of rANS states, 0 if not rANS
+  int rbit;              // Bits coded in current rANS block
+  U32 r[8];              // rANS states
+  vector<U32> rsym;      // COMPRESS: P(0)*2+y of each bit in block
+  vector<U16> rword;     // Coded rANS words of one block
+  const U16* rw;         // DECOMPRESS: next word to read
   int eofs;              // Number of EOF's read from data
   long xchars;           // Number of bytes of compressed data
   long encodes;          // Number of bits of uncompressed data
   int start_time;        // Clocks at start of compression
   long total_encodes;    // Sum of encodes
   int total_time;        // Sum of compression times
+  int get();             // Next archive byte, or 0 past end of archive
+  // Code bit y with P(0) = p/64K using AC32 or AC64 on the given copy
+  // of the coder state
+  int code32(int y, U32 p, U32& x1, U32& x2, U32& x);
+  int code64(int y, U32 p, U64& z1, U64& z2, U64& z);
+  int codeByte(int c);   // Code 8 bits of c, return the byte coded
+  template <class P> int codeBit(int y, P& pr);  // encode() using pr
+  template <class P> int codeBits(int c, P& pr);  // codeByte() using pr
+  template <class P> void codeBytes(const U8* buf, size_t n, P& pr);
+  template <class P> void primeBits(const U8* buf, size_t n, P& pr);
+  template <class... Ms> friend class Predictor;  // Calls the above
+  int codeRans(int y, U32 p);  // Code bit y with P(0) = p/64K using rANS
+  void flushRans();      // Code and write the buffered rANS block
+  void loadRans();       // Read the next rANS block
+  void init();           // Common part of the constructors
 public:
-  Encoder(Mode m, FILE* f);
+  Encoder(Mode m, FILE* f, Coder c=AC32, int model=PPM,
+    int mixers=MIXDEFAULT, int apms=APMDEFAULT);
+  Encoder(vector<U8>& v, Coder c, int model=PPM, int mixers=MIXDEFAULT,
+    int apms=APMDEFAULT);
+  Encoder(const U8* data, size_t n, Coder c, int model=PPM,
+    int mixers=MIXDEFAULT, int apms=APMDEFAULT);
   int encode(int bit=0);
+  void encodeByte(int c) {codeByte(c);}
+  void encodeBytes(const U8* buf, size_t n);
+  int decodeByte() {return codeByte(0);}
+  void prime(const U8* buf, size_t n);
   void print();
+  long tell() const {return out ? out->tell() : 0;}
+  int memory(const void** p, size_t* n) {return predictor->memory(p, n);}
+  static void compressParallel(const U8* buf, size_t n, vector<U8>& v,
+    Coder c, int model, int mixers, int apms, const U8* p=0,
+    size_t np=0);
+  static void codeInterleaved(Encoder** e, U8** buf, const size_t* n,
+    int k);
   ~Encoder();
 };
 #endif
@@ -0,0 +1,360 @@
+#include <cstdlib>
+#include <cstring>
+#include "io.h"
+#include "thread.h"
+
+using std::vector;
+#ifdef __unix__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+size_t iobufsize=IOBUF;
+#ifdef THREADS
+bool iothreads=true;
+#else
+bool iothreads=false;
+#endif
+
+// Map regular files into memory rather than streaming them (option -s)
+bool usemmap=true;
+
+S64 ftell64(FILE* f) {
+#ifdef __unix__
+  return ftello(f);
+#else
+  return _ftelli64(f);
+#endif
+}
+
+int fseek64(FILE* f, S64 offset, int whence) {
+#ifdef __unix__
+  return fseeko(f, offset, whence);
+#else
+  return _fseeki64(f, offset, whence);
+#endif
+}
+
+U8* alignedAlloc(size_t n) {
+  void* p=0;
+  if (posix_memalign(&p, 4096, n)!=0) {
+    printf("Out of memory\n");
+    exit(1);
+  }
+  return (U8*)p;
+}
+
+void alignedFree(U8* p) {
+  free(p);
+}
+
+/////////////////////////// IOThread ///////////////////////////
+
+// IOSLOTS buffers of n bytes passed between a Reader or Writer and the
+// thread doing its I/O.  A Reader thread fills the slots with fread()
+// and a Writer thread empties them with fwrite().  len[i] is the number
+// of bytes in slot i.
+struct IOThread {
+  FILE* f;
+  const size_t n;
+  U8* mem;
+  size_t len[IOSLOTS];
+  Ring ring;
+  bool eof;  // Reader: the last slot has been consumed
+#ifdef THREADS
+  ThreadID tid;
+#endif
+  IOThread(FILE* fp, size_t size): f(fp), n(size),
+      mem(alignedAlloc(n*IOSLOTS)), ring(IOSLOTS), eof(false) {}
+  U8* slot(U32 i) {return mem+i*n;}
+  ~IOThread() {alignedFree(mem);}
+};
+
+#ifdef THREADS
+// Fill slots until end of file or cancelled
+static ThreadReturn readerThread(void* arg) {
+  IOThread& t=*(IOThread*)arg;
+  while (true) {
+    for (int spins=0; t.ring.full(); Ring::wait(spins))
+      if (t.ring.cancelled()) break;
+    if (t.ring.cancelled()) break;
+    const U32 i=t.ring.back();
+    t.len[i]=fread(t.slot(i), 1, t.n, t.f);
+    if (t.len[i]==0) break;
+    t.ring.push();
+  }
+  t.ring.close();
+  return 0;
+}
+
+// Write slots until closed and empty
+static ThreadReturn writerThread(void* arg) {
+  IOThread& t=*(IOThread*)arg;
+  while (true) {
+    int spins=0;
+    while (t.ring.empty() && !t.ring.closed()) Ring::wait(spins);
+    if (t.ring.empty()) break;  // Closed
+    const U32 i=t.ring.front();
+    fwrite(t.slot(i), 1, t.len[i], t.f);
+    t.ring.pop();
+  }
+  return 0;
+}
+#endif
+
+//////////////////////////// Reader ////////////////////////////
+
+Reader::Reader(FILE* fp): f(fp), buf(0), n(iobufsize), p(0), end(0), t(0) {
+#ifdef THREADS
+  if (n>0 && iothreads) {
+    t=new IOThread(f, n);
+    run(t->tid, readerThread, t);
+    return;
+  }
+#endif
+  if (n>0) {
+    buf=alignedAlloc(n);
+    p=end=buf;
+  }
+}
+
+Reader::Reader(const U8* data, size_t len): f(0), buf(0), n(0), p(data),
+    end(data+len), t(0) {}
+
+int Reader::fill() {
+  if (!f)
+    return EOF;
+  if (t) {
+    if (t->eof)
+      return EOF;
+    if (buf)
+      t->ring.pop();  // Give back the slot just used
+    int spins=0;
+    while (t->ring.empty()) {
+      if (t->ring.closed() && t->ring.empty()) {
+        buf=0;
+        p=end=0;
+        t->eof=true;
+        return EOF;
+      }
+      Ring::wait(spins);
+    }
+    const U32 i=t->ring.front();
+    buf=t->slot(i);
+    p=buf;
+    end=buf+t->len[i];
+    return *p++;
+  }
+  if (!buf)
+    return getc(f);
+  size_t len=fread(buf, 1, n, f);
+  p=buf;
+  end=buf+len;
+  if (len==0)
+    return EOF;
+  return *p++;
+}
+
+size_t Reader::read(U8* dst, size_t len) {
+  size_t done=0;
+  while (done<len) {
+    if (p==end) {
+      if (!f)
+        break;
+      if (!t && (!buf || len-done>=n)) {  // Large or unbuffered reads bypass buf
+        size_t r=fread(dst+done, 1, len-done, f);
+        done+=r;
+        break;
+      }
+      int c=fill();
+      if (c==EOF)
+        break;
+      dst[done++]=c;
+    }
+    size_t k=end-p;
+    if (k>len-done) k=len-done;
+    memcpy(dst+done, p, k);
+    p+=k;
+    done+=k;
+  }
+  return done;
+}
+
+Reader::~Reader() {
+#ifdef THREADS
+  if (t) {
+    t->ring.cancel();
+    join(t->tid);
+    delete t;
+    return;
+  }
+#endif
+  alignedFree(buf);
+}
+
+//////////////////////////// Writer ////////////////////////////
+
+Writer::Writer(FILE* fp): f(fp), v(0), buf(0), n(iobufsize), p(0), end(0),
+    pos(0), t(0) {
+  if (n>0) {
+    pos=ftell(f);
+    if (pos<0) pos=0;  // Pipe
+#ifdef THREADS
+    if (iothreads) {
+      t=new IOThread(f, n);
+      run(t->tid, writerThread, t);
+      buf=t->slot(t->ring.back());
+    }
+#endif
+    if (!buf)
+      buf=alignedAlloc(n);
+    p=buf;
+    end=buf+n;
+  }
+}
+
+Writer::Writer(U8* data, size_t len): f(0), v(0), buf(data), n(len),
+    p(data), end(data+len), pos(0), t(0) {}
+
+Writer::Writer(vector<U8>& out): f(0), v(&out), buf(0),
+    n(iobufsize>0 ? iobufsize : 1<<16), p(0), end(0), pos(out.size()),
+    t(0) {
+  buf=alignedAlloc(n);
+  p=buf;
+  end=buf+n;
+}
+
+void Writer::flush() {
+  if (v && p>buf) {
+    v->insert(v->end(), buf, p);
+    pos+=p-buf;
+    p=buf;
+  }
+  else if (f && buf && p>buf) {
+    const size_t len=p-buf;
+    if (t) {  // Pass buf to the thread and wait for a free slot
+      t->len[t->ring.back()]=len;
+      t->ring.push();
+      for (int spins=0; t->ring.full(); Ring::wait(spins));
+      buf=t->slot(t->ring.back());
+      end=buf+n;
+    }
+    else
+      fwrite(buf, 1, len, f);
+    pos+=len;
+    p=buf;
+  }
+}
+
+void Writer::write(const U8* src, size_t len) {
+  if (!buf) {
+    fwrite(src, 1, len, f);
+    return;
+  }
+  if (size_t(end-p)>=len) {
+    memcpy(p, src, len);
+    p+=len;
+    return;
+  }
+  if (v) {
+    flush();
+    v->insert(v->end(), src, src+len);
+    pos+=len;
+    return;
+  }
+  if (!f) {  // Memory: drop what does not fit
+    memcpy(p, src, end-p);
+    p=end;
+    return;
+  }
+  flush();
+  if (t) {
+    while (len>0) {
+      const size_t k=len<n ? len : n;
+      memcpy(p, src, k);
+      p+=k;
+      src+=k;
+      len-=k;
+      if (p==end) flush();
+    }
+  }
+  else if (len>=n) {  // Large writes bypass buf
+    fwrite(src, 1, len, f);
+    pos+=len;
+  }
+  else {
+    memcpy(p, src, len);
+    p+=len;
+  }
+}
+
+Writer::~Writer() {
+  flush();
+#ifdef THREADS
+  if (t) {
+    t->ring.close();
+    join(t->tid);
+    delete t;
+    return;
+  }
+#endif
+  if (f || v)
+    alignedFree(buf);
+}
+
+////////////////////////// MappedFile //////////////////////////
+
+#ifdef __unix__
+bool MappedFile::open(const char* filename) {
+  close();
+  int fd=::open(filename, O_RDONLY);
+  if (fd<0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0) {
+    void* m=mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m!=MAP_FAILED) {
+      p=(U8*)m;
+      n=st.st_size;
+      madvise(m, n, MADV_SEQUENTIAL);
+    }
+  }
+  ::close(fd);  // The mapping stays valid
+  return p!=0;
+}
+
+bool MappedFile::create(const char* filename, size_t len) {
+  close();
+  if (len==0)
+    return false;
+  int fd=::open(filename, O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if (fd<0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st)==0 && S_ISREG(st.st_mode)
+      && posix_fallocate(fd, 0, len)==0) {
+    void* m=mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m!=MAP_FAILED) {
+      p=(U8*)m;
+      n=len;
+      madvise(m, n, MADV_SEQUENTIAL);
+    }
+  }
+  ::close(fd);
+  return p!=0;
+}
+
+void MappedFile::close() {
+  if (p)
+    munmap(p, n);
+  p=0;
+  n=0;
+}
+#else
+bool MappedFile::open(const char* filename) {return false;}
+bool MappedFile::create(const char* filename, size_t len) {return false;}
+void MappedFile::close() {}
+#endif
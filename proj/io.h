@@ -0,0 +1,131 @@
+#ifndef _IO_
+#define _IO_
+
+#include <cstdio>
+#include <cstddef>
+#include <vector>
+#include "models/utils/datatypes.h"
+
+/* Buffered byte streams over a FILE.  Data is moved in bulk through a
+large buffer aligned to a page boundary, so that the per-byte cost is a
+pointer compare and increment rather than a locked getc()/putc() call.
+
+   iobufsize is the size of each Reader and Writer buffer in bytes.  It
+     defaults to IOBUF (compile with -DIOBUF=0 to disable buffering) and
+     may be changed at run time before any streams are opened.  If it is
+     0 then every byte goes through getc()/putc() as before.
+   iothreads, if true (the default where THREADS is defined, see
+     thread.h), gives each buffered Reader and Writer on a FILE its own
+     thread which does the fread() or fwrite() calls, so the thread
+     using the stream only ever touches memory.  The buffers, IOSLOTS of
+     iobufsize bytes each, are passed between the threads through a
+     lock-free Ring.  A Reader thread reads ahead of the data used, so
+     the position of f is undefined until the Reader is destroyed.  A
+     Writer thread has written all data when the Writer is destroyed.
+
+   Reader r(f) reads from f, which must be open for reading in binary mode.
+   Reader r(p, n) reads the n bytes at p directly, without copying.
+   r.get() returns the next byte (0-255) or EOF.
+   r.read(buf, n) reads up to n bytes into buf and returns the number read.
+
+   Writer w(f) writes to f, which must be open for writing in binary mode.
+   Writer w(p, n) writes directly to the n bytes at p.  Bytes past the
+     end are dropped.
+   Writer w(v) appends to vector<U8> v, which grows as needed.
+   w.put(c) writes byte c.
+   w.write(buf, n) writes n bytes from buf.
+   w.flush() writes any buffered bytes to f.  Called by the destructor.
+   w.tell() returns the number of bytes written to f so far, as ftell().
+
+   usemmap, if true (the default), makes the callers read and write
+   regular files through a MappedFile rather than a FILE stream.
+
+   A MappedFile maps a regular file into memory.  Methods:
+   open(filename) maps an existing file read-only for sequential access.
+   create(filename, n) creates or truncates filename, preallocates n bytes
+     and maps it read-write.
+   Both return false if the file is not a regular file, is empty, or
+   cannot be mapped (or if mmap is not supported), in which case the
+   caller should fall back to a FILE stream.
+   data() returns the mapped bytes (0 if not mapped), size() the length.
+   close() unmaps the file.  Called by the destructor.
+*/
+
+#ifndef IOBUF
+#define IOBUF (1<<20)
+#endif
+extern size_t iobufsize;
+enum {IOSLOTS=4};
+extern bool iothreads;
+extern bool usemmap;
+
+// ftell() and fseek() with 64-bit offsets
+S64 ftell64(FILE* f);
+int fseek64(FILE* f, S64 offset, int whence);
+
+// Allocate n bytes aligned to a 4K page, or exit if out of memory
+U8* alignedAlloc(size_t n);
+void alignedFree(U8* p);
+
+struct IOThread;  // Reader or Writer thread, defined in io.cpp
+
+class Reader {
+  FILE* f;        // Input file, or 0 if reading from memory
+  U8* buf;        // Buffer of size n, or 0 if unbuffered
+  const size_t n;
+  const U8* p;    // Next byte to return
+  const U8* end;  // End of valid data in buf
+  IOThread* t;    // Thread filling buf, or 0
+  Reader(const Reader&);  // No copy
+  Reader& operator=(const Reader&);  // No assignment
+  int fill();     // Refill buf and return the first byte or EOF
+public:
+  Reader(FILE* f);
+  Reader(const U8* data, size_t len);
+  int get() {return p<end ? *p++ : fill();}
+  size_t read(U8* dst, size_t len);
+  ~Reader();
+};
+
+class Writer {
+  FILE* f;       // Output file, or 0 if writing to memory
+  std::vector<U8>* v;  // Output vector, or 0
+  U8* buf;       // Buffer of size n, or 0 if unbuffered
+  const size_t n;
+  U8* p;         // Next free byte in buf
+  U8* end;       // buf+n
+  long pos;      // Offset in f of buf[0]
+  IOThread* t;   // Thread writing buf, or 0
+  Writer(const Writer&);  // No copy
+  Writer& operator=(const Writer&);  // No assignment
+public:
+  Writer(FILE* f);
+  Writer(U8* data, size_t len);
+  Writer(std::vector<U8>& out);
+  void put(int c) {
+    if (p<end) *p++=c;
+    else if ((f || v) && buf) flush(), *p++=c;
+    else if (f) putc(c, f);
+  }
+  void write(const U8* src, size_t len);
+  void flush();
+  long tell() const {return buf ? pos+long(p-buf) : ftell(f);}
+  ~Writer();
+};
+
+class MappedFile {
+  U8* p;     // Mapped data or 0
+  size_t n;  // Mapped length
+  MappedFile(const MappedFile&);  // No copy
+  MappedFile& operator=(const MappedFile&);  // No assignment
+public:
+  MappedFile(): p(0), n(0) {}
+  bool open(const char* filename);
+  bool create(const char* filename, size_t len);
+  U8* data() const {return p;}
+  size_t size() const {return n;}
+  void close();
+  ~MappedFile() {close();}
+};
+
+#endif
@@ -10,23 +10,23 @@
 #include <map>
 
 #include "encoder.h"
+#include "archive.h"
+#include "io.h"
+#include "crc.h"
+#ifdef __unix__
+#include <unistd.h>
+#endif
 
 using namespace std;
 
 // Read one byte from encoder e
 int decompress(Encoder& e) {  // Decompress 8 bits, MSB first
-  int c=0;
-  for (int i=0; i<8; ++i)  
-    c=(c<<1)+e.encode();
-  return c;
+  return e.decodeByte();
 }
 
 // Write one byte c to encoder e
-void compress(Encoder& e, int c) {
-  for (int i=0; i<8; ++i) {  // Compress 8 bits, MSB first
-    e.encode((c&128)?1:0);
-    c<<=1;
-  }
+void compress(Encoder& e, int c) {  // Compress 8 bits, MSB first
+  e.encodeByte(c);
 }
 
 // Fail if out of memory
@@ -47,104 +47,435 @@ string getline(FILE* f=stdin) {
   return result;
 }
 
+/* Streaming mode compresses stdin to stdout (option -p) or extracts
+   stdin to stdout (option -d) without knowing the size in advance.
+   The archive has a text header with a "stream" line naming the
+   Predictor (see archive.h) in place of the file list.
+   The data is coded as chunks of up to CHUNK bytes, each preceded by
+   its length as 4 coded bytes, MSB first, ended by a chunk of length 0
+   and the CRC-32C of the data as 4 coded bytes.  Only one chunk is
+   buffered, so memory use does not depend on the length of the stream.
+*/
+enum {CHUNK=1<<20};
+int streaming=0;  // 'p' or 'd' if streaming
+
+// Compress all of f as chunks
+void compressStream(Encoder& e, FILE* f) {
+  Reader in(f);
+  vector<U8> buf(CHUNK);
+  size_t n;
+  U32 crc=0;
+  while ((n=in.read(&buf[0], CHUNK))>0) {
+    crc=crc32c(crc, &buf[0], n);
+    for (int i=24; i>=0; i-=8)
+      compress(e, (n>>i)&255);
+    for (size_t i=0; i<n; ++i)
+      compress(e, buf[i]);
+  }
+  for (int i=0; i<4; ++i)
+    compress(e, 0);
+  for (int i=24; i>=0; i-=8)
+    compress(e, (crc>>i)&255);
+}
+
+// Extract chunks to f up to the end of stream marker, then read and
+// verify the CRC.  Return false on a CRC error.
+bool decompressStream(Encoder& e, FILE* f) {
+  Writer out(f);
+  vector<U8> buf(CHUNK);
+  U32 crc=0;
+  while (true) {
+    U32 n=0;
+    for (int i=0; i<4; ++i)
+      n=(n<<8)+decompress(e);
+    if (n==0)
+      break;
+    while (n>0) {
+      const U32 k=min(n, U32(CHUNK));
+      for (U32 i=0; i<k; ++i)
+        buf[i]=decompress(e);
+      crc=crc32c(crc, &buf[0], k);
+      out.write(&buf[0], k);
+      n-=k;
+    }
+  }
+  U32 c=0;
+  for (int i=0; i<4; ++i)
+    c=(c<<8)+decompress(e);
+  return c==crc;
+}
+
+// Arithmetic coder for new archives (option -c)
+Coder coder=AC32;
+
+// Bytes per independently coded block, 0 = one block (option -b)
+S64 blocksize=0;
+
+// Blocks compressed or extracted at once (option -t).  With more than
+// 1 thread, or blocks interleaved (option -k), the default block size
+// is 16 MB.
+int threads=1;
+
+// Bytes of input before each block to prime its model with (option -w)
+U32 primesize=0;
+
+// Cut blocks where the content changes (option -x)
+bool contentsplit=false;
+
+// Models of the Predictor of new blocks, a ModelConfig (option -o)
+int model=PPM;
+
+// Contexts that select the mixer weights of new blocks (option -y)
+int mixers=MIXDEFAULT;
+
+// Contexts of the APMs that refine the predictions of new blocks
+// (option -z)
+int apms=APMDEFAULT;
+
+// List the archive instead of extracting it (option -l)
+bool listing=false;
+
+// Append the n bytes at offset u to h as a block, or if more than
+// blocksize as equal blocks of at most blocksize.  RANDOM content is
+// stored.
+static void addBlock(ArchiveHeader& h, S64 u, S64 n, int type=UNTYPED) {
+  const S64 k=blocksize>0 ? (n+blocksize-1)/blocksize : 1;
+  for (S64 j=0; j<k && n>0; ++j) {
+    ArchiveBlock b;
+    b.offset=b.csize=0;
+    b.uoffset=u+n*j/k;
+    b.usize=n*(j+1)/k-n*j/k;
+    b.crc=0;
+    b.coder=type==RANDOM ? STORED : coder;
+    b.prime=b.coder==STORED ? 0 : U32(min(S64(primesize), S64(b.uoffset)));
+    b.model=model;
+    b.type=type;
+    b.mixer=mixers;
+    b.apm=apms;
+    h.block.push_back(b);
+  }
+}
+
 // User interface
 int main(int argc, char** argv) {
   clock();
   set_new_handler(handler);
 
+  // Options precede the archive name
+  while (argc>1 && argv[1][0]=='-' && argv[1][1]) {
+    const string opt=argv[1];
+    if (opt=="-u")
+      iobufsize=0;
+    else if (opt=="-n")
+      iothreads=false;
+    else if (opt=="-s")
+      usemmap=false;
+    else if (opt=="-p" || opt=="-d")
+      streaming=opt[1];
+    else if (opt=="-l")
+      listing=true;
+    else if (opt=="-m")
+      modelthreads=true;
+    else if (opt=="-x")
+      contentsplit=true;
+    else if (opt=="-g")
+      pinthreads=true;
+    else if (opt=="-r")
+      numareport=true;
+    else if (opt=="-w" && argc>2) {
+      primesize=U32(max(atoi(argv[2]), 0))<<10;
+      ++argv, --argc;
+    }
+    else if (opt=="-a" && argc>2) {
+      lookahead=atoi(argv[2]);
+      if (lookahead<0) lookahead=0;
+      ++argv, --argc;
+    }
+    else if (opt=="-k" && argc>2) {
+      interleave=atoi(argv[2]);
+      if (interleave<1) interleave=1;
+      ++argv, --argc;
+    }
+    else if (opt=="-e" && argc>2) {
+      storebits=atof(argv[2]);
+      ++argv, --argc;
+    }
+    else if (opt=="-b" && argc>2) {
+      blocksize=S64(atol(argv[2]))<<20;
+      ++argv, --argc;
+    }
+    else if (opt=="-t" && argc>2) {
+      threads=atoi(argv[2]);
+      if (threads<1) threads=1;
+      ++argv, --argc;
+    }
+    else if (opt=="-c" && argc>2) {
+      int c=coderOfName(argv[2]);
+      if (c<0) {
+        printf("Unknown coder %s\n", argv[2]);
+        return 1;
+      }
+      coder=Coder(c);
+      ++argv, --argc;
+    }
+    else if (opt=="-o" && argc>2) {
+      model=modelOfName(argv[2]);
+      if (model<0) {
+        printf("Unknown models %s\n", argv[2]);
+        return 1;
+      }
+      ++argv, --argc;
+    }
+    else if (opt=="-y" && argc>2) {
+      mixers=mixerContexts(argv[2]);
+      if (mixers<0) {
+        printf("Unknown mixer contexts %s\n", argv[2]);
+        return 1;
+      }
+      ++argv, --argc;
+    }
+    else if (opt=="-z" && argc>2) {
+      apms=apmContexts(argv[2]);
+      if (apms<0) {
+        printf("Unknown APM contexts %s\n", argv[2]);
+        return 1;
+      }
+      ++argv, --argc;
+    }
+    else if (opt=="-i" && argc>2) {
+      iobufsize=atol(argv[2])<<10;
+      ++argv, --argc;
+    }
+    else {
+      printf("Unknown option %s\n", argv[1]);
+      return 1;
+    }
+    ++argv, --argc;
+  }
+
   // Check arguments
-  if (argc<2) {
+  if (argc<2 && !streaming) {
     printf(
-      "To compress:         ./paqlike archive filenames...  (archive will be created)\n"
-      "To extract/compare:  ./paqlike archive  (does not clobber existing files)\n"
-      "To view contents:    more < archive\n");
+      "To compress:         ./paqlike [options] archive filenames...  (archive will be created)\n"
+      "To extract/compare:  ./paqlike [options] archive  (does not clobber existing files)\n"
+      "To compress a pipe:  ./paqlike [options] -p < input > archive\n"
+      "To extract a pipe:   ./paqlike [options] -d < archive > output\n"
+      "To list contents:    ./paqlike -l archive\n"
+      "Options:\n"
+      "  -a K          Prefetch model contexts K bytes ahead when\n"
+      "                compressing (default %d, 0 = off)\n"
+      "  -b MB         Split the input into independent blocks of up to\n"
+      "                MB MB, grouping small files\n"
+      "  -c CODER      Coder for new archives: ac32 (default), ac64,\n"
+      "                rans2, rans4, rans8 or stored\n"
+      "  -e BITS       Store blocks estimated to need more than BITS bits\n"
+      "                per byte without compressing them (default 7.9)\n"
+      "  -g            Pin each coding thread to a CPU and keep its model\n"
+      "                tables on that CPU's NUMA node\n"
+      "  -i KB         I/O buffer size in KB (default %d)\n"
+      "  -k N          Code N blocks at once on each thread, interleaved\n"
+      "                bit by bit to overlap their memory accesses (4-16,\n"
+      "                sets -b 16 if -b is not given)\n"
+      "  -m            Compress with each model in its own thread\n"
+      "  -n            Do file I/O in the coding thread, not in separate\n"
+      "                reader and writer threads\n"
+      "  -o MODELS     Models for new archives: ppm (default, contexts of\n"
+      "                up to 7 bytes), ppm4 (up to 3 bytes) or none\n"
+      "  -r            Report the NUMA nodes of the model tables of each\n"
+      "                block coded in a thread (with -t or -k)\n"
+      "  -s            Stream files through stdio instead of memory mapping\n"
+      "  -t N          Compress or extract N blocks at once in N threads,\n"
+      "                which steal blocks from each other when idle\n"
+      "                (default 1, sets -b 16 if -b is not given)\n"
+      "  -u            Unbuffered I/O, one getc()/putc() per byte (-i 0)\n"
+      "  -w KB         Prime the model of each block with the KB KB of\n"
+      "                input before it.  The blocks of such an archive\n"
+      "                are extracted in order by one thread.\n"
+      "  -x            Cut blocks where the input changes between text,\n"
+      "                binary and random data, at most -b MB each\n"
+      "  -y CTX        Select the mixer weights by the contexts CTX, any\n"
+      "                of b (bits of the byte so far), c (class of the\n"
+      "                last byte) and m (whether the byte so far matches\n"
+      "                the last byte), or - for none (default %s)\n"
+      "  -z ORDERS     Refine predictions with an APM for each context\n"
+      "                order in ORDERS, any of 0, 1 and 2, or - for none\n"
+      "                (default %s)\n",
+      lookahead, int(IOBUF>>10), mixerContextNames(MIXDEFAULT).c_str(),
+      apmContextNames(APMDEFAULT).c_str());
     return 1;
   }
 
-  // File names and sizes from input or archive
-  vector<string> filename; // List of names
-  vector<long> filesize;   // Size or -1 if error
+  // File names from input
+  vector<string> filename;
+
+  // In streaming mode, data goes to a copy of stdout and messages that
+  // would go to stdout go to stderr instead
+  FILE* data=stdout;
+  if (streaming) {
+    if (argc>1) {
+      printf("No file names are allowed with -p or -d\n");
+      return 1;
+    }
+#ifdef __unix__
+    fflush(stdout);
+    data=fdopen(dup(1), "wb");
+    dup2(2, 1);
+#endif
+  }
+
+  // Compress stdin to stdout
+  if (streaming=='p') {
+    if (coder==STORED) {
+      printf("-c stored is not supported with -p\n");
+      return 1;
+    }
+    fprintf(data, "%s\r\nstream crc32c model %s mixer %s apm %s\r\n",
+      coderTag(coder), modelName(model), mixerContextNames(mixers).c_str(),
+      apmContextNames(apms).c_str());
+    putc(032, data);
+    putc('\f', data);
+    putc(0, data);
+    {
+      Encoder e(COMPRESS, data, coder, model, mixers, apms);
+      printf("stdin: ");
+      compressStream(e, stdin);
+      e.print();
+    }
+    fclose(data);
+    return 0;
+  }
 
   // Extract files
-  FILE* archive=fopen(argv[1], "rb");
+  const char* name=streaming ? "stdin" : argv[1];  // Archive name
+  FILE* archive=streaming ? stdin : fopen(argv[1], "rb");
   if (archive) {
     if (argc>2) {
       printf("File %s already exists\n", argv[1]);
       return 1;
     }
-    printf("Extracting archive %s ...\n", argv[1]);
-
-    // Read "PAQ1\r\n" at start of archive
-    if (getline(archive) != "PAQ1") {
-      printf("Archive file %s not in paqlike format\n", argv[1]);
+    ArchiveHeader h;
+    if (!h.read(archive)) {
+      printf("Archive file %s not in paqlike format\n", name);
       return 1;
     }
-
-    // Read "size filename" in "%10d %s\r\n" format
-    while (true) {
-      string s=getline(archive);
-      if (s.size()>10) {
-        filesize.push_back(atol(s.c_str()));
-        filename.push_back(s.substr(11));
-      }
+    if (listing) {
+      h.list();
+      return 0;
+    }
+    printf("Extracting archive %s ...\n", name);
+    if (h.stream!=(streaming=='d')) {
+      if (h.stream)
+        printf("%s is a stream archive, extract with -d < %s\n", name, name);
       else
-        break;
+        printf("%s is not a stream archive\n", name);
+      return 1;
     }
 
-    // Test end of header for "\f\0"
-    {
-      int c1=0, c2=0;
-      if ((c1=getc(archive))!='\f' || (c2=getc(archive))!=0) {
-        printf("%s: Bad PAQ1 header format %d %d\n", argv[1],
-          c1, c2);
+    // Extract a stream archive to stdout
+    if (h.stream) {
+      bool ok;
+      {
+        const ArchiveBlock& b=h.block[0];
+        Encoder e(DECOMPRESS, archive, Coder(b.coder), b.model, b.mixer,
+          b.apm);
+        ok=decompressStream(e, data);
+      }
+      fclose(data);
+      if (!ok) {
+        printf("Archive corrupted: CRC error\n");
         return 1;
       }
+      return 0;
     }
 
-    // Extract files from archive data
-    Encoder e(DECOMPRESS, archive);
-    for (int i=0; i<int(filename.size()); ++i) {
-      printf("%10ld %s: ", filesize[i], filename[i].c_str());
+    // Extract files from archive data.  The CRC of each file is checked
+    // as it is decoded.
+    BlockReader r(archive, h, threads);
+    vector<U8> buf(1<<16);
+    int errors=0;
+    for (int i=0; i<int(h.file.size()); ++i) {
+      const char* filename=h.file[i].name.c_str();
+      const S64 size=h.file[i].size;
+      U32 crc=0;
+      printf("%10lld %s: ", (long long)size, filename);
 
       // Compare with existing file
-      FILE* f=fopen(filename[i].c_str(), "rb");
-      const long size=filesize[i];
+      FILE* f=fopen(filename, "rb");
+      MappedFile m;
       if (f) {
+        Reader* in=usemmap && m.open(filename)
+          ? new Reader(m.data(), m.size()) : new Reader(f);
         bool different=false;
-        for (long j=0; j<size; ++j) {
-          int c1=decompress(e);
-          int c2=getc(f);
-          if (!different && c1!=c2) {
-            printf("differ at offset %ld, archive=%d file=%d\n",
-              j, c1, c2);
-            different=true;
+        for (S64 j=0; j<size; j+=buf.size()) {
+          const size_t n=min(S64(buf.size()), size-j);
+          r.read(&buf[0], n);
+          crc=crc32c(crc, &buf[0], n);
+          for (size_t k=0; k<n; ++k) {
+            int c1=buf[k];
+            int c2=in->get();
+            if (!different && c1!=c2) {
+              printf("differ at offset %lld, archive=%d file=%d\n",
+                (long long)(j+k), c1, c2);
+              different=true;
+            }
           }
         }
-        if (!different)
+        if (crc!=h.file[i].crc)
+          printf("CRC error\n"), ++errors;
+        else if (!different)
           printf("identical\n");
+        delete in;
         fclose(f);
       }
 
+      // Extract to a preallocated mapping of the new file
+      else if (usemmap && m.create(filename, size)) {
+        r.read(m.data(), size);
+        crc=crc32c(0, m.data(), size);
+        m.close();
+        if (crc!=h.file[i].crc)
+          printf("CRC error\n"), ++errors;
+        else
+          printf("extracted\n");
+      }
+
       // Extract to new file
       else {
-        f=fopen(filename[i].c_str(), "wb");
-        if (!f)
+        f=fopen(filename, "wb");
+        if (!f) {
           printf("cannot create, skipping...\n");
-        for (long j=0; j<size; ++j) {
-          int c=decompress(e);
-          if (f)
-            putc(c, f);
+          for (S64 j=0; j<size; j+=buf.size())
+            r.read(&buf[0], min(S64(buf.size()), size-j));
+          ++errors;
         }
-        if (f) {
-          printf("extracted\n");
+        else {
+          {
+            Writer out(f);
+            for (S64 j=0; j<size; j+=buf.size()) {
+              const size_t n=min(S64(buf.size()), size-j);
+              r.read(&buf[0], n);
+              crc=crc32c(crc, &buf[0], n);
+              out.write(&buf[0], n);
+            }
+          }
+          if (crc!=h.file[i].crc)
+            printf("CRC error\n"), ++errors;
+          else
+            printf("extracted\n");
           fclose(f);
         }
       }
     }
+    if (errors)
+      return 1;
   }
 
   // Compress files
   else {
+    if (listing) {
+      printf("Archive %s not found\n", argv[1]);
+      return 1;
+    }
 
     // Read file names from command line or input
     if (argc>2)
@@ -163,62 +494,125 @@ int main(int argc, char** argv) {
     }
 
     // Get file sizes
+    ArchiveHeader h;
+    S64 total=0;
     for (int i=0; i<int(filename.size()); ++i) {
       FILE* f=fopen(filename[i].c_str(), "rb");
       if (!f) {
         printf("File not found, skipping: %s\n",
           filename[i].c_str());
-        filesize.push_back(-1);
+        continue;
       }
-      else {
-        fseek(f, 0L, SEEK_END);
-        filesize.push_back(ftell(f));
-        fclose(f);
+      fseek64(f, 0, SEEK_END);
+      ArchiveFile af;
+      af.name=filename[i];
+      af.size=ftell64(f);
+      af.offset=total;
+      fclose(f);
+      if (af.size<0) {
+        printf("Cannot get size, skipping: %s\n", filename[i].c_str());
+        continue;
       }
+      total+=af.size;
+      h.file.push_back(af);
     }
-    if (filesize.size()==0
-        || *max_element(filesize.begin(), filesize.end())<0) {
+    if (h.file.size()==0) {
       printf("No files to compress, no archive created.\n");
       return 1;
     }
 
-    // Write header
+    // Split the files into blocks.  A file of at least blocksize bytes
+    // is split into equal blocks of at most blocksize.  Smaller files
+    // are grouped into solid blocks of up to blocksize.  With option -x
+    // blocks are instead cut where the content changes.
+    if ((threads>1 || interleave>1) && blocksize==0)
+      blocksize=S64(16)<<20;
+    if (contentsplit) {
+      vector<ContentRun> run;
+      scanContent(h, run);
+      for (int i=0; i<int(run.size()); ++i)
+        addBlock(h, run[i].offset, run[i].size, run[i].type);
+    }
+    else {
+      S64 u=0;  // Start of the current group of small files
+      for (int i=0; i<int(h.file.size()) && blocksize>0; ++i) {
+        const S64 start=h.file[i].offset, size=h.file[i].size;
+        if (size>=blocksize) {
+          addBlock(h, u, start-u);
+          addBlock(h, start, size);
+          u=start+size;
+        }
+        else if (start+size-u>blocksize) {
+          addBlock(h, u, start-u);
+          u=start;
+        }
+      }
+      addBlock(h, u, total-u);
+    }
+    probeBlocks(h);
+
+    // Write header, leaving the block offsets to be filled in later
     archive=fopen(argv[1], "wb");
     if (!archive) {
       printf("Cannot create archive: %s\n", argv[1]);
       return 1;
     }
-    fprintf(archive, "PAQ1\r\n");
-    for (int i=0; i<int(filename.size()); ++i) {
-      if (filesize[i]>=0)
-        fprintf(archive, "%10ld %s\r\n", filesize[i], filename[i].c_str());
-    }
-    putc(032, archive);
-    putc('\f', archive);
-    putc(0, archive);
+    h.write(archive);
 
-    // Write data
-    Encoder e(COMPRESS, archive);
-    for (int i=0; i<int(filename.size()); ++i) {
-      const int size=filesize[i];
-      if (size>=0) {
-        printf("%s: ", filename[i].c_str());
-        FILE* f=fopen(filename[i].c_str(), "rb");
-        int c;
-        for (long j=0; j<size; ++j) {
-          if (f)
-            c=getc(f);
-          else
-            c=0;
-          compress(e, c);
+    // Write data, computing the CRC of each file as it is read
+    if ((threads<=1 && !modelthreads && interleave<=1)
+        || !compressBlocks(archive, h, threads)) {
+      BlockWriter w(archive, h);
+      vector<U8> buf(1<<16);
+      for (int i=0; i<int(h.file.size()); ++i) {
+        const char* filename=h.file[i].name.c_str();
+        const S64 size=h.file[i].size;
+        printf("%s: ", filename);
+
+        // Code straight from a mapping of the file if possible, a WINDOW
+        // at a time so it is read once for the CRC and coding, else
+        // stream it.  A file that is missing or shorter than before is
+        // padded with 0.
+        MappedFile m;
+        FILE* f=0;
+        if (!usemmap || !m.open(filename))
+          f=fopen(filename, "rb");
+        if (m.data() && S64(m.size())>=size) {
+          U32 crc=0;
+          for (S64 j=0; j<size; j+=WINDOW) {
+            const size_t n=size_t(min(S64(WINDOW), size-j));
+            crc=crc32c(crc, m.data()+j, n);
+            w.write(m.data()+j, n);
+          }
+          h.file[i].crc=crc;
+          w.print();
+          continue;
         }
-        if (f) {
-          fclose(f);
-          e.print();
+        Reader* in=0;
+        if (f || m.data())
+          in=f ? new Reader(f) : new Reader(m.data(), m.size());
+        U32 crc=0;
+        for (S64 j=0; j<size; j+=buf.size()) {
+          const size_t n=min(S64(buf.size()), size-j);
+          const size_t k=in ? in->read(&buf[0], n) : 0;
+          fill(buf.begin()+k, buf.begin()+n, 0);
+          crc=crc32c(crc, &buf[0], n);
+          w.write(&buf[0], n);
+        }
+        h.file[i].crc=crc;
+        if (in) {
+          delete in;
+          if (f)
+            fclose(f);
+          w.print();
         }
       }
     }
+
+    // Rewrite header with the block offsets
+    fseek64(archive, 0, SEEK_SET);
+    h.write(archive);
+    fclose(archive);
   }
   return 0;
 }
-
@@ -0,0 +1,234 @@
+#include <cstring>
+#include <algorithm>
+#include "mixer.h"
+
+#if !defined(NOSIMD) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define MIXER_SIMD
+#include <immintrin.h>
+#endif
+
+// Invert squash().  This runs before main(), so before any Mixer or
+// model is created.
+static const short* stretchInit() {
+  static short t[4096];
+  int pi=0;
+  for (int x=-2047; x<=2047; ++x) {
+    const int i=squash(x);
+    for (int j=pi; j<=i; ++j)
+      t[j]=x;
+    pi=i+1;
+  }
+  for (int j=pi; j<4096; ++j)
+    t[j]=2047;
+  return t;
+}
+
+const short* const stretch_table=stretchInit();
+
+// Scalar reference versions.  The vector versions give the same results.
+static int dotScalar(const short* t, const short* w, int n) {
+  int sum=0;
+  for (int i=0; i<n; i+=2)
+    sum+=(t[i]*w[i]+t[i+1]*w[i+1]) >> 8;
+  return sum;
+}
+
+static void trainScalar(const short* t, short* w, int n, int err) {
+  for (int i=0; i<n; ++i) {
+    int wt=w[i]+(((t[i]*err*2>>16)+1)>>1);
+    if (wt<-32768) wt=-32768;
+    if (wt>32767) wt=32767;
+    w[i]=wt;
+  }
+}
+
+/* Vector versions, for n a multiple of 8.  Each does as many elements
+   as fit its registers and leaves the rest to the next narrower one.
+   The dot product sums pairs of products with pmaddwd and shifts each
+   pair sum as the scalar version does, and integer addition in any
+   order gives the same sum.  Training computes the rounded product
+   (t*err*2>>16)+1>>1 = (t*err+32768)>>16 from its high and low halves
+   as hi+(lo>>15), which is exact, and adds it with saturation, which is
+   the clamp. */
+#ifdef MIXER_SIMD
+__attribute__((target("sse2")))
+static int dotSSE2(const short* t, const short* w, int n) {
+  __m128i sum=_mm_setzero_si128();
+  for (int i=0; i<n; i+=8) {
+    const __m128i p=_mm_madd_epi16(_mm_loadu_si128((const __m128i*)(t+i)),
+      _mm_loadu_si128((const __m128i*)(w+i)));
+    sum=_mm_add_epi32(sum, _mm_srai_epi32(p, 8));
+  }
+  sum=_mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+  sum=_mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+  return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("sse2")))
+static void trainSSE2(const short* t, short* w, int n, int err) {
+  const __m128i e=_mm_set1_epi16(err);
+  for (int i=0; i<n; i+=8) {
+    const __m128i x=_mm_loadu_si128((const __m128i*)(t+i));
+    const __m128i d=_mm_add_epi16(_mm_mulhi_epi16(x, e),
+      _mm_srli_epi16(_mm_mullo_epi16(x, e), 15));
+    __m128i* p=(__m128i*)(w+i);
+    _mm_storeu_si128(p, _mm_adds_epi16(_mm_loadu_si128(p), d));
+  }
+}
+
+__attribute__((target("avx2")))
+static int dotAVX2(const short* t, const short* w, int n) {
+  __m256i sum=_mm256_setzero_si256();
+  int i=0;
+  for (; i+16<=n; i+=16) {
+    const __m256i p=_mm256_madd_epi16(
+      _mm256_loadu_si256((const __m256i*)(t+i)),
+      _mm256_loadu_si256((const __m256i*)(w+i)));
+    sum=_mm256_add_epi32(sum, _mm256_srai_epi32(p, 8));
+  }
+  __m128i s=_mm_add_epi32(_mm256_castsi256_si128(sum),
+    _mm256_extracti128_si256(sum, 1));
+  s=_mm_add_epi32(s, _mm_srli_si128(s, 8));
+  s=_mm_add_epi32(s, _mm_srli_si128(s, 4));
+  return _mm_cvtsi128_si32(s)+(i<n ? dotSSE2(t+i, w+i, n-i) : 0);
+}
+
+__attribute__((target("avx2")))
+static void trainAVX2(const short* t, short* w, int n, int err) {
+  const __m256i e=_mm256_set1_epi16(err);
+  int i=0;
+  for (; i+16<=n; i+=16) {
+    const __m256i x=_mm256_loadu_si256((const __m256i*)(t+i));
+    const __m256i d=_mm256_add_epi16(_mm256_mulhi_epi16(x, e),
+      _mm256_srli_epi16(_mm256_mullo_epi16(x, e), 15));
+    __m256i* p=(__m256i*)(w+i);
+    _mm256_storeu_si256(p, _mm256_adds_epi16(_mm256_loadu_si256(p), d));
+  }
+  if (i<n)
+    trainSSE2(t+i, w+i, n-i, err);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int dotAVX512(const short* t, const short* w, int n) {
+  const __m512i zero=_mm512_setzero_si512();
+  __m512i sum=zero;
+  int i=0;
+  for (; i+32<=n; i+=32) {
+    const __m512i p=_mm512_madd_epi16(_mm512_loadu_si512(t+i),
+      _mm512_loadu_si512(w+i));
+
+    // The unmasked shift and extracts pass an undefined vector as the
+    // masked-off source, which GCC warns is uninitialized
+    sum=_mm512_add_epi32(sum, _mm512_mask_srai_epi32(zero, 0xffff, p, 8));
+  }
+  const __m256i zero4=_mm256_setzero_si256();
+  __m256i s=_mm256_add_epi32(_mm512_mask_extracti64x4_epi64(zero4, 0xf,
+    sum, 0), _mm512_mask_extracti64x4_epi64(zero4, 0xf, sum, 1));
+  __m128i s4=_mm_add_epi32(_mm256_castsi256_si128(s),
+    _mm256_extracti128_si256(s, 1));
+  s4=_mm_add_epi32(s4, _mm_srli_si128(s4, 8));
+  s4=_mm_add_epi32(s4, _mm_srli_si128(s4, 4));
+  return _mm_cvtsi128_si32(s4)+(i<n ? dotAVX2(t+i, w+i, n-i) : 0);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void trainAVX512(const short* t, short* w, int n, int err) {
+  const __m512i e=_mm512_set1_epi16(err);
+  int i=0;
+  for (; i+32<=n; i+=32) {
+    const __m512i x=_mm512_loadu_si512(t+i);
+    const __m512i d=_mm512_add_epi16(_mm512_mulhi_epi16(x, e),
+      _mm512_srli_epi16(_mm512_mullo_epi16(x, e), 15));
+    _mm512_storeu_si512(w+i, _mm512_adds_epi16(_mm512_loadu_si512(w+i), d));
+  }
+  if (i<n)
+    trainAVX2(t+i, w+i, n-i, err);
+}
+#endif
+
+// The kernels, by MixerKernel
+typedef int (*DotProduct)(const short*, const short*, int);
+typedef void (*Train)(const short*, short*, int, int);
+static const char* kernel_names[NKERNELS]={"scalar", "sse2", "avx2",
+  "avx512"};
+#ifdef MIXER_SIMD
+static const DotProduct dot_kernels[NKERNELS]={dotScalar, dotSSE2, dotAVX2,
+  dotAVX512};
+static const Train train_kernels[NKERNELS]={trainScalar, trainSSE2,
+  trainAVX2, trainAVX512};
+#else
+static const DotProduct dot_kernels[NKERNELS]={dotScalar, 0, 0, 0};
+static const Train train_kernels[NKERNELS]={trainScalar, 0, 0, 0};
+#endif
+
+static bool kernelSupported(int k) {
+#ifdef MIXER_SIMD
+  switch (k) {
+    case SSE2: return __builtin_cpu_supports("sse2");
+    case AVX2: return __builtin_cpu_supports("avx2");
+    case AVX512: return __builtin_cpu_supports("avx512f")
+      && __builtin_cpu_supports("avx512bw");
+  }
+#endif
+  return k==SCALAR;
+}
+
+// Choose the widest kernel.  This runs before main(), so before any
+// threads are started.
+static int kernelInit() {
+  int k=NKERNELS-1;
+  while (!kernelSupported(k))
+    --k;
+  return k;
+}
+
+static int kernel=kernelInit();
+static DotProduct dotImpl=dot_kernels[kernel];
+static Train trainImpl=train_kernels[kernel];
+
+int dot_product(const short* t, const short* w, int n) {
+  return dotImpl(t, w, (n+7)&-8);
+}
+
+void train(const short* t, short* w, int n, int err) {
+  trainImpl(t, w, (n+7)&-8, err);
+}
+
+bool setMixerKernel(int k) {
+  if (k<0 || k>=NKERNELS || !kernelSupported(k))
+    return false;
+  kernel=k;
+  dotImpl=dot_kernels[k];
+  trainImpl=train_kernels[k];
+  return true;
+}
+
+int mixerKernel() {
+  return kernel;
+}
+
+const char* mixerKernelName(int k) {
+  return kernel_names[k];
+}
+
+Mixer::Mixer(int n, int m, int s, int w): N((n+MIXPAD-1)&-MIXPAD), M(m),
+    S(s), cxt(new int[s]), pr(new int[s]), ncxt(0), base(0), nx(0), mp(0) {
+  mem=new char[N*(M+1)*sizeof(short)+MIXALIGN];
+  tx=(short*)(mem+(MIXALIGN-size_t(mem)%MIXALIGN)%MIXALIGN);
+  wx=tx+N;
+  memset(tx, 0, N*sizeof(short));
+  for (int i=0; i<N*M; ++i)
+    wx[i]=w;
+  for (int i=0; i<S; ++i)
+    pr[i]=2048;
+  if (S>1)
+    mp=new Mixer(S, 1, 1, std::min(65536/S, 32767));
+}
+
+Mixer::~Mixer() {
+  delete mp;
+  delete[] pr;
+  delete[] cxt;
+  delete[] mem;
+}
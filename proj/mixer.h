@@ -0,0 +1,136 @@
+#ifndef _MIXER_
+#define _MIXER_
+
+#include <cstddef>
+#include "models/utils/datatypes.h"
+
+/* Logistic mixing, after paq8f.  Probabilities are 12 bit numbers
+(0 to 4095) and are mixed in the logistic domain, where they are
+stretched to st = ln(p/(1-p)) scaled by 8 bits (-2047 to 2047,
+representing -8 to 8).
+
+   squash(d) returns p = 1/(1 + exp(-d)), the inverse of stretch(),
+     interpolated from a table of 33 points.
+   stretch(p) returns the d in -2047..2047 with squash(d) closest to p,
+     from a table built at program start by inverting squash().
+
+   dot_product(t, w, n) returns the sum of t[i]*w[i] for i < n, each
+     pair of products scaled down by 8 bits.  n is rounded up to a
+     multiple of 8.
+   train(t, w, n, err) adds t[i]*err to w[i] for i < n, scaled down by
+     16 bits, rounded and clamped to +-32K.  err is scaled by 16 bits
+     (representing +- 1/2).  n is rounded up to a multiple of 8.
+   t must be padded with zeros to a multiple of 8, and t and w are best
+   aligned to MIXALIGN bytes.  t[i] and err must be in -32767..32767,
+   so that no product overflows.
+
+   On x86 CPUs these use SSE2, AVX2 or AVX-512 (with AVX512BW) vector
+   instructions, the widest the CPU has, chosen at program start.  All
+   give the same results as the scalar version, so an archive decodes
+   the same on any CPU.  Compile with -DNOSIMD to always use the scalar
+   version.
+   mixerKernel() returns the MixerKernel in use.
+   setMixerKernel(k) uses MixerKernel k instead, and returns false if
+     the CPU does not have it.  Call it before starting any threads.
+   mixerKernelName(k) returns the name of MixerKernel k.
+
+   A Mixer combines predictions with M single layer neural networks of
+   up to N inputs each, which share the inputs, selecting up to S of
+   them for each bit by context.  If S > 1 then the outputs of the
+   selected networks are combined by another Mixer (S, 1, 1), else the
+   output is direct.
+   Mixer m(n, m, s, w) creates it with N = n and M = m networks, whose
+     weights are initially w (+-32K, 65536 = 1.0).  The inputs and the
+     weights are allocated once, aligned to MIXALIGN bytes and padded
+     to a multiple of MIXPAD, so mixing them is a few vector
+     instructions.  The weights of the M networks are contiguous, so
+     selecting one is an offset.
+   m.inputs() points to the N inputs.  The caller stores up to N
+     stretched probabilities there, nominally +-256 to +-2K, positive
+     to predict a 1 bit.
+   m.set(cx, range) selects network cx of the next range ones, 0 <= cx
+     < range.  Called up to S times per bit, with ranges totaling at
+     most M, so that each context selects from its own networks.  If it
+     is not called, network 0 is used.
+   m.p(k) returns the mixed prediction of inputs()[0..k-1] as a 12 bit
+     P(1), squash of the weighted sum of each selected network.
+   m.update(y) trains the selected networks to reduce the coding cost of
+     bit y (0 or 1) given the last p(), with learning rate MIXRATE, and
+     clears the selection for the next bit.
+*/
+
+enum {MIXALIGN=64, MIXPAD=32, MIXRATE=7};
+
+inline int squash(int d) {
+  static const int t[33]={
+    1,2,3,6,10,16,27,45,73,120,194,310,488,747,1101,
+    1546,2047,2549,2994,3348,3607,3785,3901,3975,4022,
+    4050,4068,4079,4085,4089,4092,4093,4094};
+  if (d>2047) return 4095;
+  if (d<-2047) return 0;
+  const int w=d&127;
+  d=(d>>7)+16;
+  return (t[d]*(128-w)+t[d+1]*w+64) >> 7;
+}
+
+extern const short* const stretch_table;  // 4096 entries
+inline int stretch(int p) {return stretch_table[p];}
+
+int dot_product(const short* t, const short* w, int n);
+void train(const short* t, short* w, int n, int err);
+
+enum MixerKernel {SCALAR, SSE2, AVX2, AVX512, NKERNELS};
+int mixerKernel();
+bool setMixerKernel(int k);
+const char* mixerKernelName(int k);
+
+class Mixer {
+  const int N, M, S;  // Inputs (a multiple of MIXPAD), networks, selected
+  char* mem;    // Allocation holding tx and wx
+  short* tx;    // N inputs, zero past nx
+  short* wx;    // N*M weights, N per network
+  int* cxt;     // S selected networks
+  int* pr;      // S last outputs
+  int ncxt;     // Number of networks selected
+  int base;     // First network of the next set()
+  int nx;       // Number of inputs of the last p()
+  Mixer* mp;    // Combines the S outputs, or 0 if S = 1
+public:
+  Mixer(int n, int m=1, int s=1, int w=0);
+  short* inputs() {return tx;}
+  void set(int cx, int range) {
+    cxt[ncxt++]=base+cx;
+    base+=range;
+  }
+  int p(int k) {
+    for (int i=k; i<nx; ++i)  // Keep the unused inputs zero
+      tx[i]=0;
+    nx=k;
+    if (ncxt==0)
+      set(0, 1);
+    if (mp) {
+      short* x=mp->inputs();
+      for (int i=0; i<ncxt; ++i) {
+        pr[i]=squash(dot_product(tx, wx+cxt[i]*N, nx)>>8);
+        x[i]=stretch(pr[i]);
+      }
+      return mp->p(ncxt);
+    }
+    return pr[0]=squash(dot_product(tx, wx+cxt[0]*N, nx)>>8);
+  }
+  void update(int y) {
+    if (mp)
+      mp->update(y);
+    for (int i=0; i<ncxt; ++i) {
+      const int err=((y<<12)-pr[i])*MIXRATE;
+      train(tx, wx+cxt[i]*N, nx, err);
+    }
+    ncxt=base=0;
+  }
+  ~Mixer();
+private:
+  Mixer(const Mixer&);  // No copy or assignment
+  Mixer& operator=(const Mixer&);
+};
+
+#endif
@@ -1,15 +1,46 @@
+#ifndef _MODEL_
+#define _MODEL_
+
+#include <cstddef>
+
 /* Model interface.  A Predictor is made up of a collection of various
-models, whose outputs are summed to yield a prediction.  Methods:
+models, whose outputs are mixed by a Mixer (see mixer.h) to yield a
+prediction.  Methods:
 
-   Model.predict(int& n0, int& n1) - Adds to counts n0 and n1 such that
-     it predicts the next bit will be a 1 with probability n1/(n0+n1)
-     and confidence n0+n1.
+   Model.predict(short* x) - Stores its predictions that the next bit
+     will be a 1 in x[0..inputs()-1] as stretched probabilities
+     (stretch(p), positive for a 1) and returns inputs().  The Mixer
+     learns how much to trust each.
+   Model.inputs() - The number of predictions predict() stores, which
+     does not change.
    Model.update(int y) - Appends bit y (0 or 1) to the model.
+   Model.updateBit(int y) - update(y) for a bit that does not end a byte.
+   Model.updateByte(int y) - update(y) for the last bit of a byte.  Models
+     override these two to skip testing for the end of a byte on every bit.
+   Model.lookahead(int c) - Says that c will be coded after the bytes
+     passed to lookahead() before, so that the model can prefetch the
+     memory it will need to code the byte after c.  Only a hint: the
+     model's predictions must not depend on it.
+   Model.memory(p, n) stores the address and size in bytes of each large
+     table of the model in p[i] and n[i] for i < MAXTABLES and returns
+     their number, so that it can be reported where they are.
+
+   A Predictor calls a model through its own type (see predictor.h), so
+   these calls are direct and can be inlined.  Declare a model final so
+   that the compiler knows no subclass overrides them.  The interface is
+   for the code that only lists or runs models of any type.
 */
 class Model {
 public:
-  virtual void predict() const = 0;
+  enum {MAXTABLES=4};
+  virtual int predict(short* x) = 0;
+  virtual int inputs() const = 0;
   virtual void update(int y) = 0;
+  virtual void updateBit(int y) {update(y);}
+  virtual void updateByte(int y) {update(y);}
+  virtual void lookahead(int /*c*/) {}
+  virtual int memory(const void** /*p*/, size_t* /*n*/) const {return 0;}
   virtual ~Model() {}
 };
 
+#endif
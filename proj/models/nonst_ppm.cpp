@@ -1,8 +1,11 @@
+#include <vector>
 #include "utils/util.cpp"
+#include "../model.h"
+#include "../mixer.h"
 /*
  * Example model here
  * A NonstationaryPPM model guesses the next bit by finding all
-matching contexts of n = 1 to 8 bytes (including the last partial
+matching contexts of n = 1 to N bytes (including the last partial
 byte of 0-7 bits) and guessing for each match that the next bit
 will be the same with weight n^2/f(age).  The function f(age) decays
 the count of 0s or 1s for each context by half whenever there are
@@ -12,63 +15,176 @@ number of subsequent observations and the variance is tp(1-p) for
 t observations and p the probability of a 1 bit given the last t
 observations.  The aged counts are stored in a hash table of 8M
 contexts.
+
+predict() gives the mixer one input per context, the stretched
+probability (n1+1/2)/(n0+n1+1) of its counts, so the mixer learns the
+weight of each context length instead of it being fixed at n^2.  The
+input of each Counter state is tabulated in st[], so this costs a
+lookup per context and no division.
+
+The hash table lookups for the next bit are the slow part, since each
+is likely a cache miss.  So update() only computes their indexes and
+prefetches them, and they are looked up by fetch() in the next call to
+predict() or update().  A caller that codes several streams in turn
+(see Encoder::codeInterleaved()) then waits for the misses of all of
+them at once.
+
+When compressing, the data is known, and lookahead() computes hash[] as
+it will be some bytes ahead to prefetch the counters of those contexts.
+The 8 bits of a byte use counter2[hash[i]+cn] for cn in 1..52, so this
+is a few cache lines per context.
+
+When decompressing, the next byte is not known, but the next bit has
+only two possible contexts, c0*2 and c0*2+1.  So predict() prefetches
+the counters of both while the current bit is being coded.  If the
+bit ends a byte, these are the first counters of the next byte, whose
+hashes are computed for both possible values of the byte.
+
+NonstationaryPPM<N> models the N contexts of lengths 0 to N-1, N >= 2.
+It is a template so that a Predictor can combine several orders, each
+with its loops unrolled to its own N (see predictor.h).
 */
-class NonstationaryPPM: public Model {
-  enum {N=8};  // Number of contexts
+template <int N> class NonstationaryPPM final: public Model {
   int c0;  // Current 0-7 bits of input with a leading 1
   int c1;  // Previous whole byte
   int cn;  // c0 mod 53 (low bits of hash)
-  vector<Counter> counter0;  // Counters for context lengths 0 and 1
-  vector<Counter> counter1;
+  std::vector<Counter> counter0;  // Counters for context lengths 0 and 1
+  std::vector<Counter> counter1;
   Hashtable<Counter, 24> counter2;  // for lengths 2 to N-1
   Counter *cp[N];  // Pointers to current counters
   U32 hash[N];   // Hashes of last 0 to N-1 bytes
+  U32 idx[N];    // Indexes of cp[2..N-1] in counter2, if not fetched
+  bool fetched;  // cp[] is up to date
+  U32 ahash[N];  // hash[] after the bytes passed to lookahead()
+  Random rnd;    // For Counter increments
+  short st[Counter::STATES];  // Mixer input of each Counter state
+  void fetch();  // Look up cp[2..N-1]
+  void next();   // Find the counters for the next bit
+  void speculate() const;  // Prefetch for both values of the next bit
 public:
-  inline void predict();  // Add to counts of 0s and 1s
+  inline int predict(short* x);  // Store N mixer inputs in x
+  int inputs() const {return N;}
   inline void update(int y);   // Append bit y (0 or 1) to model
+  inline void updateBit(int y);   // update(y) within a byte
+  inline void updateByte(int y);  // update(y) for the last bit of a byte
+  inline void lookahead(int c);   // Prefetch for the byte after c
+  int memory(const void** p, size_t* n) const;  // Tables
   NonstationaryPPM();
 };
 
-NonstationaryPPM::NonstationaryPPM(): c0(1), c1(0), cn(1),
-     counter0(256), counter1(65536) {
+template <int N> NonstationaryPPM<N>::NonstationaryPPM(): c0(1), c1(0),
+     cn(1), counter0(256), counter1(65536), fetched(true) {
   for (int i=0; i<N; ++i) {
     cp[i]=&counter0[0];
-    hash[i]=0;
+    hash[i]=idx[i]=ahash[i]=0;
+  }
+  for (int s=0; s<Counter::STATES; ++s) {
+    const int n0=Counter::get0(s), n1=Counter::get1(s);
+    st[s]=stretch((n1*2+1)*4096/(n0*2+n1*2+2));
   }
 }
 
-void NonstationaryPPM::predict() {
+template <int N> void NonstationaryPPM<N>::fetch() {
+  for (int i=2; i<N; ++i)
+    cp[i]=&counter2[idx[i]];
+  fetched=true;
+}
 
-  for (int i=0; i<N; ++i) {
-    const int wt=(i+1)*(i+1);
-    n0+=cp[i]->get0()*wt;
-    n1+=cp[i]->get1()*wt;
+template <int N> void NonstationaryPPM<N>::next() {
+  cp[0]=&counter0[c0];
+  cp[1]=&counter1[c0+(c1<<8)];
+  for (int i=2; i<N; ++i)
+    counter2.prefetch(idx[i]=hash[i]+cn+(c0<<24));
+  fetched=false;
+}
+
+template <int N> void NonstationaryPPM<N>::speculate() const {
+  if (c0<128) {  // The next bit is in this byte
+    for (int y=0; y<2; ++y) {
+      int cn1=cn*2+y;
+      if (cn1>=53) cn1-=53;
+      for (int i=2; i<N; ++i)
+        counter2.prefetch(hash[i]+cn1);
+    }
+  }
+  else {  // The next bit starts a byte, with cn = 1
+    for (int y=0; y<2; ++y) {
+      const int c=c0*2+y;
+      for (int i=2; i<N; ++i)
+        counter2.prefetch((hash[i-1]+c)*987660757+1);
+    }
   }
 }
 
+template <int N> int NonstationaryPPM<N>::predict(short* x) {
+  if (!fetched)
+    fetch();
+  speculate();
+
+  for (int i=0; i<N; ++i)
+    x[i]=st[cp[i]->getState()];
+  return N;
+}
+
 // Add bit y (0 or 1) to model
-void NonstationaryPPM::update(int y) {
+template <int N> void NonstationaryPPM<N>::update(int y) {
+  if (c0>=128)  // y is the 8th bit
+    updateByte(y);
+  else
+    updateBit(y);
+}
+
+// Add bit y to model, where y is not the last bit of a byte
+template <int N> void NonstationaryPPM<N>::updateBit(int y) {
 
   // Count y by context
+  if (!fetched)
+    fetch();
   for (int i=0; i<N; ++i)
     if (cp[i])
-      cp[i]->add(y);
+      cp[i]->add(y, rnd);
 
   // Store bit y
   cn+=cn+y;
   if (cn>=53) cn-=53;
   c0+=c0+y;
-  if (c0>=256) {  // Start new byte
-    for (int i=N-1; i>0; --i)
-      hash[i]=(hash[i-1]+c0)*987660757;
-    c1=c0-256;
-    c0=1;
-    cn=1;
-  }
 
   // Set up pointers to next counters
-  cp[0]=&counter0[c0];
-  cp[1]=&counter1[c0+(c1<<8)];
+  next();
+}
+
+// Add the last bit y of a byte to model and start a new byte
+template <int N> void NonstationaryPPM<N>::updateByte(int y) {
+  if (!fetched)
+    fetch();
+  for (int i=0; i<N; ++i)
+    if (cp[i])
+      cp[i]->add(y, rnd);
+  c0+=c0+y;
+  for (int i=N-1; i>0; --i)
+    hash[i]=(hash[i-1]+c0)*987660757;
+  c1=c0-256;
+  c0=1;
+  cn=1;
+  next();
+}
+
+// Prefetch the counters of the contexts of the byte after c
+template <int N> void NonstationaryPPM<N>::lookahead(int c) {
+  c+=256;  // As c0 after the last bit of c
+  for (int i=N-1; i>0; --i)
+    ahash[i]=(ahash[i-1]+c)*987660757;
   for (int i=2; i<N; ++i)
-    cp[i]=&counter2[hash[i]+cn+(c0<<24)];
+    counter2.prefetch(ahash[i]+1, 52);
+}
+
+template <int N>
+int NonstationaryPPM<N>::memory(const void** p, size_t* n) const {
+  p[0]=&counter0[0];
+  n[0]=counter0.size()*sizeof(Counter);
+  p[1]=&counter1[0];
+  n[1]=counter1.size()*sizeof(Counter);
+  p[2]=counter2.data();
+  n[2]=counter2.bytes();
+  return 3;
 }
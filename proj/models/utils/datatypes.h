@@ -1,9 +1,13 @@
 #ifndef _DATATYPES_
 #define _DATATYPES_
-// 8-32 bit unsigned types, adjust as appropriate
-typedef unsigned char U8;
-typedef unsigned short U16;
-typedef unsigned long U32;
+#include <stdint.h>
+// Fixed width unsigned types.  U32 must be exactly 32 bits: the coders
+// and hashes rely on arithmetic wrapping modulo 2^32.
+typedef uint8_t U8;
+typedef uint16_t U16;
+typedef uint32_t U32;
+typedef uint64_t U64;
+typedef int64_t S64;  // Signed, for file sizes and offsets
 
 class U24 {  // 24-bit unsigned int
   U8 b0, b1, b2;  // Low, mid, high byte
@@ -1,21 +1,98 @@
 #include "predictor.h"
-U16 
-Predictor::p() {
-    int n0=1, n1=n0;
-//    m1.predict(n0, n1);
-//    m2.predict(n0, n1);
-//    m3.predict(n0, n1);
-//    m4.predict(n0, n1);
-//    return a function of the model predictions
-//    CALL EXTERNAL HERE?
-    return U16(65535.0*n1/(n0+n1));
-}
-
-void 
-Predictor::update(int y) {
-//    m1.update(y);
-//    m2.update(y);
-//    m3.update(y);
-//    m4.update(y);
+
+// Letters and numbers of weight sets of each MixerContext
+static const char mixer_letters[NMIXCONTEXTS+1]="bcm";
+static const int mixer_sets[NMIXCONTEXTS]={256, 64, 16};
+
+int mixerContexts(const char* s) {
+    if (s[0]=='-' && s[1]==0)
+        return 0;
+    int mc=0;
+    for (; *s; ++s) {
+        int i=0;
+        while (i<NMIXCONTEXTS && mixer_letters[i]!=*s)
+            ++i;
+        if (i==NMIXCONTEXTS)
+            return -1;
+        mc|=1<<i;
+    }
+    return mc ? mc : -1;
+}
+
+std::string mixerContextNames(int mc) {
+    std::string s;
+    for (int i=0; i<NMIXCONTEXTS; ++i)
+        if (mc>>i&1)
+            s+=mixer_letters[i];
+    return s.size() ? s : "-";
+}
+
+// Weight sets of the mixer with contexts mc, and how many are selected
+static int mixerSets(int mc) {
+    int m=0;
+    for (int i=0; i<NMIXCONTEXTS; ++i)
+        if (mc>>i&1)
+            m+=mixer_sets[i];
+    return m ? m : 1;
+}
+
+static int mixerSelected(int mc) {
+    int s=0;
+    for (int i=0; i<NMIXCONTEXTS; ++i)
+        s+=mc>>i&1;
+    return s ? s : 1;
+}
+
+// Digits and numbers of contexts of each APMContext
+static const char apm_digits[NAPMCONTEXTS+1]="012";
+static const int apm_contexts[NAPMCONTEXTS]={256, 65536, 65536};
+
+int apmContexts(const char* s) {
+    if (s[0]=='-' && s[1]==0)
+        return 0;
+    int ac=0;
+    for (; *s; ++s) {
+        int i=0;
+        while (i<NAPMCONTEXTS && apm_digits[i]!=*s)
+            ++i;
+        if (i==NAPMCONTEXTS)
+            return -1;
+        ac|=1<<i;
+    }
+    return ac ? ac : -1;
+}
+
+std::string apmContextNames(int ac) {
+    std::string s;
+    for (int i=0; i<NAPMCONTEXTS; ++i)
+        if (ac>>i&1)
+            s+=apm_digits[i];
+    return s.size() ? s : "-";
+}
+
+// Store the number of contexts of each APM of ac in n and return how
+// many there are
+static int apmMaps(int ac, int* n) {
+    int k=0;
+    for (int i=0; i<NAPMCONTEXTS; ++i)
+        if (ac>>i&1)
+            n[k++]=apm_contexts[i];
+    return k;
+}
+
+// Class of byte c: 0 control, 1 space, 2 digit, 3 upper case letter,
+// 4 lower case letter, 5 other ASCII, 6 line break, 7 not ASCII
+int byteClass(int c) {
+    if (c>=128) return 7;
+    if (c=='\n' || c=='\r') return 6;
+    if (c==' ') return 1;
+    if (c<32 || c==127) return 0;
+    if (c>='0' && c<='9') return 2;
+    if (c>='A' && c<='Z') return 3;
+    if (c>='a' && c<='z') return 4;
+    return 5;
 }
 
+PredictorBase::PredictorBase(int mixers, int apms): mc(mixers),
+    mixer(MAXINPUTS, mixerSets(mixers), mixerSelected(mixers), 1<<14),
+    ac(apms), apm(apmMaps(apms, an), an), c0(1), bits(0), c4(0) {}
@@ -1,22 +1,201 @@
+#ifndef _PREDICTOR_
+#define _PREDICTOR_
+
 #include "models/utils/datatypes.h"
+#include "model.h"
+#include "mixer.h"
+#include "apm.h"
 #include "models/nonst_ppm.cpp"
 #include <vector>
+#include <string>
 
 /* A Predictor predicts the next bit given the bits so far using a
-collection of models.  Methods:
+collection of models.  Predictor<M1, M2, ...> has a member of each
+model type Mi, a final Model (see model.h), and calls each by its type,
+so the calls per bit are direct and inlined and the compiler sees the
+whole loop over the models.  The models of a Predictor are fixed when
+it is compiled: the configurations that an archive can use are listed
+in encoder.cpp and chosen per block by number (see ModelConfig in
+encoder.h).  Methods:
 
+   Predictor(mc) creates it with the mixer contexts mc, a set of
+     MixerContext bits.  Each bit selects a weight set of the mixer by
+     one context, and if there are several, their outputs are mixed
+     again (see Mixer):
+       MIXBIT    the bits of the current byte so far (256 sets)
+       MIXCLASS  the class of the last byte (see byteClass()) and the
+                 bit position (64 sets)
+       MIXMATCH  whether the bits of the current byte so far match the
+                 last byte, and the bit position (16 sets)
+     With none, one weight set is used for all bits.  The contexts
+     are chosen per block (see archive.h), so the decoder must use the
+     same.  mixerContexts(s) parses the letters b, c and m of these
+     (or "-" for none) into mc, and returns -1 if s is not valid.
+     mixerContextNames(mc) returns the letters of mc.
+   Predictor(mc, ac) also refines the output of the mixer with a chain
+     of APMs (see apm.h), one for each APMContext bit of ac:
+       APMORDER0  the bits of the current byte so far (256 contexts)
+       APMORDER1  those and the last byte (64K contexts)
+       APMORDER2  those and a hash of the last 2 bytes (64K contexts)
+     The APMs' average gets 3/4 of the weight and the mixer 1/4.  With
+     none, the mixer's output is used directly.  These are also chosen
+     per block.  apmContexts(s) parses the digits 0, 1 and 2 of these
+     (or "-" for none) and apmContextNames(ac) returns them.
+   Predictor<>() has no models, so the mixer and the APMs predict from
+     the bias and their contexts alone.
    p() returns probability of a 1 being the next bit, P(y = 1)
-     as a 16 bit number (0 to 64K-1).
-   update(y) updates the models with bit y (0 or 1)
+     as a 16 bit number (0 to 64K-1).  Each model stores its inputs
+     to the mixer in inputs(), and mix() combines them.
+   update(y) trains the mixer and updates the models with bit y (0 or 1)
+   updateBit(y) is update(y) for a bit known not to end a byte.
+   updateByte(y) is update(y) for the last bit of a byte, where the
+     models do their per-byte work.
+   lookahead(c) passes Model::lookahead(c) to the models.
+   models(m, loop) stores pointers to the models used by p() in
+     m[0..n-1] and returns n <= MAXMODELS.  The inputs each model gives
+     for a bit depend only on the data and not on the other models, so
+     when the data is known they can be computed in other threads (see
+     Encoder::compressParallel()).  If loop is not 0 then loop[i] is
+     set to a thread function that runs model i by its type.
+   inputs() points to the MAXINPUTS inputs of the mixer.
+   mix(n) returns p() given the n inputs stored in inputs() by the
+     models, in the order of models().  It adds a bias input.
+   train(y) trains the mixer and the APMs on bit y and moves their
+     contexts to the next bit, which update() does first.
+   memory(p, n) stores the tables of all models as Model::memory() does,
+     up to MAXMODELS * Model::MAXTABLES of them, and returns the number.
+
+   All Predictors derive from PredictorBase, which holds the mixer and
+   the APMs and has mix(), train(), inputs(), models() and memory().
+   An Encoder holds a PredictorBase and codes through its virtual
+   methods, one call per bit, byte or buffer, which call the Encoder's
+   own code for the Predictor's type (see encoder.cpp):
+   encode(e, y) codes bit y as e.encode(y).
+   codeByte(e, c) codes byte c as e.encodeByte(c).
+   encodeBytes(e, buf, n) codes buf[0..n-1] as e.encodeBytes(buf, n).
+   prime(e, buf, n) primes with buf[0..n-1] as e.prime(buf, n).
+
+   Models<M1, M2, ...> is the list of models of a Predictor.  It has the
+   methods of a Model, each calling those of M1, M2, ... in order, and
+   each(v) calls v(m) with each model m by its type.
 */
 
-class Predictor {
-  NonstationaryPPM m1;
-//  MatchModel m2;
-//  WordModel m3;
-//  CyclicModel m4;
+enum MixerContext {MIXBIT=1, MIXCLASS=2, MIXMATCH=4, NMIXCONTEXTS=3,
+  MIXDEFAULT=MIXBIT|MIXCLASS|MIXMATCH};
+int mixerContexts(const char* s);
+std::string mixerContextNames(int mc);
+int byteClass(int c);
+
+enum APMContext {APMORDER0=1, APMORDER1=2, APMORDER2=4, NAPMCONTEXTS=3,
+  APMDEFAULT=APMORDER0|APMORDER1};
+int apmContexts(const char* s);
+std::string apmContextNames(int ac);
+
+class Encoder;
+typedef void* (*ModelLoop)(void* arg);  // A model's thread function
+
+class PredictorBase {
+  const int mc;  // Mixer contexts, MixerContext bits
+  Mixer mixer;   // Combines the predictions of the models
+  const int ac;  // APM contexts, APMContext bits
+  int an[MAXAPMS];  // Contexts of each APM
+  APM apm;       // Refines the mixer's prediction
+  int c0;        // Bits of the current byte so far with a leading 1
+  int bits;      // Number of them, 0-7
+  U32 c4;        // Last 4 bytes
+public:
+  enum {MAXMODELS=8, MAXINPUTS=64};
+  PredictorBase(int mixers, int apms);
+  short* inputs() {return mixer.inputs();}
+  U16 mix(int n) {
+    inputs()[n++]=256;  // Bias
+    if (mc&MIXBIT)
+      mixer.set(c0, 256);
+    const int c1=c4&255;
+    if (mc&MIXCLASS)
+      mixer.set(byteClass(c1)*8+bits, 64);
+    if (mc&MIXMATCH)
+      mixer.set((((c1|256)>>(8-bits))==c0)*8+bits, 16);
+    const int pr=mixer.p(n);
+    if (!ac)
+      return U16(pr*16+8);
+    int cx[MAXAPMS]={0}, k=0;  // Zeroed to quiet -Wmaybe-uninitialized
+    if (ac&APMORDER0)
+      cx[k++]=c0;
+    if (ac&APMORDER1)
+      cx[k++]=c0|c1<<8;
+    if (ac&APMORDER2)
+      cx[k++]=(c0^(c4&0xffff)*2654435761u>>16)&0xffff;
+    return U16((pr*16+apm.p(pr, cx)*3)>>2);
+  }
+  void train(int y) {
+    mixer.update(y);
+    if (ac)
+      apm.update(y);
+    c0+=c0+y;
+    if (++bits==8) {
+      c4=c4<<8|(c0&255);
+      c0=1;
+      bits=0;
+    }
+  }
+  virtual int encode(Encoder& e, int y) = 0;
+  virtual int codeByte(Encoder& e, int c) = 0;
+  virtual void encodeBytes(Encoder& e, const U8* buf, size_t n) = 0;
+  virtual void prime(Encoder& e, const U8* buf, size_t n) = 0;
+  virtual void lookahead(int c) = 0;
+  virtual int models(Model** m, ModelLoop* loop=0) = 0;
+  virtual int memory(const void** p, size_t* n) = 0;
+  virtual ~PredictorBase() {}
+};
+
+template <class... Ms> class Models {  // No models
+public:
+  int predict(short*) {return 0;}
+  void update(int) {}
+  void updateBit(int) {}
+  void updateByte(int) {}
+  void lookahead(int) {}
+  int memory(const void**, size_t*) const {return 0;}
+  template <class V> void each(V&) {}
+};
+
+template <class M, class... Ms> class Models<M, Ms...> {
+  M m;
+  Models<Ms...> rest;
+public:
+  int predict(short* x) {
+    const int n=m.predict(x);
+    return n+rest.predict(x+n);
+  }
+  void update(int y) {m.update(y); rest.update(y);}
+  void updateBit(int y) {m.updateBit(y); rest.updateBit(y);}
+  void updateByte(int y) {m.updateByte(y); rest.updateByte(y);}
+  void lookahead(int c) {m.lookahead(c); rest.lookahead(c);}
+  int memory(const void** p, size_t* n) const {
+    const int k=m.memory(p, n);
+    return k+rest.memory(p+k, n+k);
+  }
+  template <class V> void each(V& v) {v(m); rest.each(v);}
+};
+
+template <class... Ms> class Predictor final: public PredictorBase {
+  Models<Ms...> m;
+  static_assert(sizeof...(Ms)<=MAXMODELS, "too many models");
 public:
-  U16 p();
-  void update(int y); 
+  Predictor(int mixers=MIXDEFAULT, int apms=APMDEFAULT):
+    PredictorBase(mixers, apms) {}
+  U16 p() {return mix(m.predict(inputs()));}
+  void update(int y) {train(y); m.update(y);}
+  void updateBit(int y) {train(y); m.updateBit(y);}
+  void updateByte(int y) {train(y); m.updateByte(y);}
+  void lookahead(int c) {m.lookahead(c);}
+  int memory(const void** p, size_t* n) {return m.memory(p, n);}
+  int models(Model** p, ModelLoop* loop=0);  // These in encoder.cpp
+  int encode(Encoder& e, int y);
+  int codeByte(Encoder& e, int c);
+  void encodeBytes(Encoder& e, const U8* buf, size_t n);
+  void prime(Encoder& e, const U8* buf, size_t n);
 };
 
+#endif
@@ -0,0 +1,588 @@
+/* Tests of paqlike, run by make test.  Each test codes fixed input and
+compares the output with a golden vector, its size and CRC-32C, recorded
+here when the format was last changed on purpose.  A change that alters
+the output of any coder, model or archive format fails here, so a format
+change must be deliberate: update the vectors, and for archives the
+format version (see archive.h).  Each output is also decoded and
+compared with the input.
+
+The program prints a line per failure and returns the number of
+failures.  Tests that need temporary files create them in the current
+directory.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../encoder.h"
+#include "../crc.h"
+#include "../io.h"
+#include "../archive.h"
+#include "../mixer.h"
+
+using namespace std;
+
+static int failures=0;
+
+// Count a failure of test name if ok is false
+static void check(bool ok, const string& name) {
+  if (!ok) {
+    printf("FAILED: %s\n", name.c_str());
+    ++failures;
+  }
+}
+
+// Fill buf with n bytes of deterministic input: words of text with
+// runs of binary data and of noise, so every model and coder path is
+// exercised
+static void makeInput(vector<U8>& buf, size_t n) {
+  static const char* words[]={"the ", "of ", "model ", "coder ",
+    "predict", "ion ", "bit ", "byte ", "context ", "archive ", "\r\n",
+    "and ", "a ", "block ", "0123 ", "hash "};
+  U32 x=12345;
+  buf.clear();
+  while (buf.size()<n) {
+    x=x*1103515245+12345;
+    const int r=x>>16&1023;
+    if (r<8) {  // Noise
+      for (int i=0; i<200; ++i)
+        buf.push_back((x=x*1103515245+12345)>>24);
+    }
+    else if (r<16) {  // Binary: little endian counts
+      for (U32 i=0; i<64; ++i)
+        for (int j=0; j<4; ++j)
+          buf.push_back(((r<<8)+i)>>(j*8));
+    }
+    else {
+      const char* w=words[r&15];
+      buf.insert(buf.end(), w, w+strlen(w));
+    }
+  }
+  buf.resize(n);
+}
+
+// Golden output of a coder: size and CRC-32C
+struct Golden {
+  size_t size;
+  U32 crc;
+};
+
+// Print the output of a test in the form of a Golden
+static void report(const string& name, const vector<U8>& out,
+    const Golden& g) {
+  const U32 crc=crc32c(0, out.size() ? &out[0] : 0, out.size());
+  printf("%-24s %8lu %08x", name.c_str(), (unsigned long)out.size(), crc);
+  if (out.size()!=g.size || crc!=g.crc) {
+    printf("  expected %lu %08x\n", (unsigned long)g.size, g.crc);
+    check(false, name+" golden vector");
+  }
+  else
+    printf("  ok\n");
+}
+
+///////////////////////////// Coders /////////////////////////////
+
+enum {CODERINPUT=1<<16};
+
+// Output of the default Predictor on makeInput(CODERINPUT) for each
+// coder but STORED
+static const Golden coder_golden[STORED]={
+  {19271, 0x0b251929},  // AC32
+  {19272, 0xf2234bec},  // AC64
+  {19310, 0x33a256e0},  // RANS2
+  {19310, 0x1bec41dc},  // RANS4
+  {19328, 0xc45ddc34}}; // RANS8
+
+// Compress in with coder c, by bits, bytes or buffer, to out
+static void compressWith(const vector<U8>& in, Coder c, int by,
+    vector<U8>& out) {
+  out.clear();
+  Encoder e(out, c);
+  if (by==0) {
+    for (size_t i=0; i<in.size(); ++i)
+      for (int j=7; j>=0; --j)
+        e.encode(in[i]>>j&1);
+  }
+  else if (by==1) {
+    for (size_t i=0; i<in.size(); ++i)
+      e.encodeByte(in[i]);
+  }
+  else
+    e.encodeBytes(&in[0], in.size());
+}
+
+static void testCoders() {
+  vector<U8> in, out, out2, dec(CODERINPUT);
+  makeInput(in, CODERINPUT);
+  for (int c=0; c<STORED; ++c) {
+    const string name=coderName(Coder(c));
+    compressWith(in, Coder(c), 2, out);
+    report(name, out, coder_golden[c]);
+
+    // Coding by bit or by byte gives the same output
+    compressWith(in, Coder(c), 1, out2);
+    check(out2==out, name+" encodeByte() same as encodeBytes()");
+    compressWith(in, Coder(c), 0, out2);
+    check(out2==out, name+" encode() same as encodeBytes()");
+
+    // Decoding by byte and by bit gives the input
+    {
+      Encoder e(&out[0], out.size(), Coder(c));
+      for (size_t i=0; i<dec.size(); ++i)
+        dec[i]=e.decodeByte();
+    }
+    check(dec==in, name+" round trip by byte");
+    {
+      Encoder e(&out[0], out.size(), Coder(c));
+      for (size_t i=0; i<dec.size(); ++i) {
+        int b=0;
+        for (int j=0; j<8; ++j)
+          b=b*2+e.encode();
+        dec[i]=b;
+      }
+    }
+    check(dec==in, name+" round trip by bit");
+  }
+}
+
+////////////////////////////// CRC //////////////////////////////
+
+// CRC-32C one bit at a time, the definition
+static U32 crcReference(U32 crc, const U8* buf, size_t n) {
+  crc=~crc;
+  for (size_t i=0; i<n; ++i) {
+    crc^=buf[i];
+    for (int j=0; j<8; ++j)
+      crc=crc>>1^(0x82F63B78&-(crc&1));
+  }
+  return ~crc;
+}
+
+static void testCRC() {
+  const int before=failures;
+  check(crc32c(0, (const U8*)"123456789", 9)==0xE3069283,
+    "crc32c check value");
+  check(crc32c(0, 0, 0)==0, "crc32c of nothing");
+
+  // Every length and alignment up to 64, and pieces of a buffer
+  vector<U8> in;
+  makeInput(in, CODERINPUT);
+  bool ok=true;
+  for (int i=0; i<8; ++i)
+    for (int n=0; n<=64; ++n)
+      ok&=crc32c(0, &in[i], n)==crcReference(0, &in[i], n);
+  check(ok, "crc32c short buffers");
+  const U32 whole=crc32c(0, &in[0], in.size());
+  check(whole==crcReference(0, &in[0], in.size()), "crc32c long buffer");
+  ok=true;
+  for (size_t cut=0; cut<=in.size(); cut+=in.size()/7+13) {
+    const U32 a=crc32c(0, &in[0], cut);
+    const U32 b=crc32c(0, &in[cut], in.size()-cut);
+    ok&=crc32c(a, &in[cut], in.size()-cut)==whole;
+    ok&=crc32cCombine(a, b, in.size()-cut)==whole;
+  }
+  check(ok, "crc32c pieces and crc32cCombine()");
+  printf("%-24s %-17s %s\n", "crc32c", crc32cHardware() ? "sse4.2"
+    : "portable", failures==before ? "ok" : "FAILED");
+}
+
+////////////////////////////// Mixer //////////////////////////////
+
+// Compare dot_product() and train() of each MixerKernel the CPU has with
+// the scalar reference, on random inputs, weights and errors of every
+// length up to 192, including the extremes that saturate the weights
+static void testKernels() {
+  const int before=failures;
+  const int kernel=mixerKernel();
+  enum {N=192};
+  short t[N], w0[N], w[NKERNELS][N];
+  int dot[NKERNELS];
+  bool has[NKERNELS];
+  string names;
+  for (int k=0; k<NKERNELS; ++k)
+    if ((has[k]=setMixerKernel(k)))
+      names+=string(names.size() ? " " : "")+mixerKernelName(k);
+  U32 x=1;
+  bool ok=true;
+  for (int it=0; it<20000; ++it) {
+    const int n=(it%(N/8)+1)*8, range=it%3;
+    for (int i=0; i<n; ++i) {
+      x=x*1103515245+12345;
+      t[i]=range==0 ? int(x>>20)-2047 : range==1 ? int(x>>16)%65535-32767
+        : x>>31 ? -32767 : 32767;
+      x=x*1103515245+12345;
+      w0[i]=range==2 ? (x>>31 ? -32768 : 32767) : short(x>>16);
+    }
+    x=x*1103515245+12345;
+    const int err=range==2 ? (x>>31 ? -32767 : 32767)
+      : int(x>>16)%65535-32767;
+    for (int k=0; k<NKERNELS; ++k) {
+      if (!has[k])
+        continue;
+      setMixerKernel(k);
+      memcpy(w[k], w0, sizeof(w0));
+      dot[k]=dot_product(t, w[k], n);
+      train(t, w[k], n, err);
+      ok&=dot[k]==dot[SCALAR] && memcmp(w[k], w[SCALAR], n*2)==0;
+    }
+  }
+  setMixerKernel(kernel);
+  check(ok, "mixer kernels agree with scalar");
+  printf("%-24s %-17s %s\n", "mixer kernels", names.c_str(),
+    failures==before ? "ok" : "FAILED");
+}
+
+/////////////////////////////// I/O ///////////////////////////////
+
+// Write a few buffers' worth to a file through a Writer, with and
+// without a writer thread, and check tell() and the file
+static void testWriter() {
+  const int before=failures;
+  vector<U8> in;
+  makeInput(in, CODERINPUT);
+  const bool threads=iothreads;
+  for (int t=0; t<2; ++t) {
+    iothreads=t;
+    const string name=string("Writer")+(t ? " with thread" : "");
+    FILE* f=tmpfile();
+    if (!f) {
+      check(false, name+" tmpfile()");
+      break;
+    }
+    bool ok=true;
+    S64 total=0;
+    {
+      Writer w(f);
+      for (int i=0; i<int(iobufsize/in.size()*7/2); ++i) {
+        w.write(&in[0], in.size());
+        w.put(i);
+        total+=in.size()+1;
+        ok&=w.tell()==total;
+      }
+    }
+    check(ok, name+" tell()");
+    check(ftell64(f)==total, name+" file size");
+    rewind(f);
+    vector<U8> back(in.size()+1);
+    ok=true;
+    for (int i=0; i<int(iobufsize/in.size()*7/2); ++i)
+      ok&=fread(&back[0], 1, back.size(), f)==back.size()
+        && memcmp(&back[0], &in[0], in.size())==0 && back.back()==U8(i);
+    check(ok, name+" contents");
+    fclose(f);
+  }
+  iothreads=threads;
+  printf("%-24s %-17s %s\n", "Writer", "", failures==before ? "ok"
+    : "FAILED");
+}
+
+///////////////////////////// Archives /////////////////////////////
+
+// Create the test input files, the first three kinds of makeInput()
+// and a file of noise, and list them in h
+static void makeFiles(ArchiveHeader& h) {
+  static const char* names[]={"in0.tmp", "in1.tmp", "in2.tmp"};
+  static const size_t sizes[]={150000, 70000, 20000};
+  vector<U8> in;
+  S64 total=0;
+  U32 x=1;
+  h.file.clear();
+  for (int i=0; i<3; ++i) {
+    makeInput(in, sizes[i]);
+    if (i==2)
+      for (size_t j=0; j<in.size(); ++j)
+        in[j]=(x=x*1103515245+12345)>>24;  // Noise
+    FILE* f=fopen(names[i], "wb");
+    if (f) {
+      fwrite(&in[0], 1, in.size(), f);
+      fclose(f);
+    }
+    ArchiveFile af;
+    af.name=names[i];
+    af.size=in.size();
+    af.offset=total;
+    af.crc=crc32c(0, &in[0], in.size());
+    total+=af.size;
+    h.file.push_back(af);
+  }
+}
+
+// Append a block of the n bytes at offset u of the files of h, coded
+// with c
+static void addBlock(ArchiveHeader& h, U64 u, U64 n, Coder c) {
+  ArchiveBlock b;
+  b.offset=b.csize=0;
+  b.uoffset=u;
+  b.usize=n;
+  b.crc=0;
+  b.prime=0;
+  b.coder=c;
+  b.model=PPM;
+  b.type=UNTYPED;
+  b.mixer=MIXDEFAULT;
+  b.apm=APMDEFAULT;
+  h.block.push_back(b);
+}
+
+// Make blocks of up to n bytes covering the files of h, coded with c
+static void makeBlocks(ArchiveHeader& h, S64 n, Coder c) {
+  const S64 total=h.file.back().offset+h.file.back().size;
+  h.block.clear();
+  for (S64 u=0; u<total; u+=n)
+    addBlock(h, u, min(n, total-u), c);
+}
+
+// Read file name into contents.  Return false if it is not one.
+static bool readFile(const char* name, vector<U8>& contents) {
+  contents.clear();
+  FILE* f=fopen(name, "rb");
+  if (!f)
+    return false;
+  U8 buf[1<<12];
+  size_t n;
+  while ((n=fread(buf, 1, sizeof(buf), f))>0)
+    contents.insert(contents.end(), buf, buf+n);
+  fclose(f);
+  return true;
+}
+
+// Write the files of h to archive name as main does, with a
+// BlockWriter if threads is 0, else compressBlocks().  A file that is
+// missing or shorter than its size in h is padded with 0.
+static void writeArchive(const char* name, ArchiveHeader& h, int threads) {
+  FILE* f=fopen(name, "wb+");
+  if (!f) {
+    check(false, string("create ")+name);
+    return;
+  }
+  h.write(f);
+  if (threads==0 || !compressBlocks(f, h, threads)) {
+    BlockWriter w(f, h);
+    for (int i=0; i<int(h.file.size()); ++i) {
+      vector<U8> in;
+      readFile(h.file[i].name.c_str(), in);
+      in.resize(h.file[i].size);
+      w.write(in.size() ? &in[0] : 0, in.size());
+      h.file[i].crc=crc32c(0, in.size() ? &in[0] : 0, in.size());
+    }
+  }
+  fseek64(f, 0, SEEK_SET);
+  h.write(f);
+  fclose(f);
+}
+
+// Extract archive name with the given number of threads and check each
+// file against the input files and their CRCs
+static void checkExtract(const char* name, int threads, const string& test) {
+  FILE* f=fopen(name, "rb");
+  ArchiveHeader h;
+  if (!f || !h.read(f)) {
+    check(false, test+" read header");
+    if (f)
+      fclose(f);
+    return;
+  }
+  bool ok=true;
+  {
+    BlockReader r(f, h, threads);
+    vector<U8> in, out;
+    for (int i=0; i<int(h.file.size()); ++i) {
+      readFile(h.file[i].name.c_str(), in);
+      out.resize(h.file[i].size);
+      r.read(out.size() ? &out[0] : 0, out.size());
+      ok&=out==in && crc32c(0, &out[0], out.size())==h.file[i].crc;
+    }
+  }
+  fclose(f);
+  check(ok, test+" extract");
+}
+
+static void testArchives() {
+  const int before=failures;
+  ArchiveHeader h;
+  makeFiles(h);
+
+  // With any number of threads, the same archive
+  makeBlocks(h, 50000, AC32);
+  writeArchive("serial.tmp", h, 0);
+  vector<U8> serial, threaded;
+  readFile("serial.tmp", serial);
+  for (int t=1; t<=3; t+=2) {
+    writeArchive("threads.tmp", h, t);
+    readFile("threads.tmp", threaded);
+    check(threaded==serial, "compressBlocks() same as BlockWriter");
+  }
+  checkExtract("serial.tmp", 1, "archive");
+  checkExtract("serial.tmp", 3, "archive with threads");
+  remove("threads.tmp");
+  remove("serial.tmp");
+  for (int i=0; i<int(h.file.size()); ++i)
+    remove(h.file[i].name.c_str());
+  printf("%-24s %-17s %s\n", "archive", "", failures==before ? "ok"
+    : "FAILED");
+}
+
+// A file that shrinks or goes missing after the header is written is
+// padded with 0 to its size in the header, by both compressBlocks() and
+// BlockWriter, and the files after it are unaffected
+static void testShrunk() {
+  const int before=failures;
+  ArchiveHeader h;
+  makeFiles(h);
+  makeBlocks(h, 250000, AC32);  // All files in one block
+  vector<U8> in;
+  readFile("in0.tmp", in);
+  in.resize(1000);
+  FILE* f=fopen("in0.tmp", "wb");
+  if (f) {
+    fwrite(&in[0], 1, in.size(), f);
+    fclose(f);
+  }
+  remove("in1.tmp");
+  vector<U8> serial, threaded;
+  for (int t=1; t<=2; ++t) {
+    writeArchive("threads.tmp", h, t);
+    readFile("threads.tmp", threaded);
+    writeArchive("serial.tmp", h, 0);
+    readFile("serial.tmp", serial);
+    check(threaded==serial, "shrunk compressBlocks() same as BlockWriter");
+  }
+
+  // The archive holds in0.tmp padded, in1.tmp as zeros and in2.tmp
+  in.resize(h.file[0].size);
+  f=fopen("in0.tmp", "wb");
+  if (f) {
+    fwrite(&in[0], 1, in.size(), f);
+    fclose(f);
+  }
+  in.assign(h.file[1].size, 0);
+  f=fopen("in1.tmp", "wb");
+  if (f) {
+    fwrite(&in[0], 1, in.size(), f);
+    fclose(f);
+  }
+  checkExtract("threads.tmp", 2, "shrunk");
+  remove("threads.tmp");
+  remove("serial.tmp");
+  for (int i=0; i<int(h.file.size()); ++i)
+    remove(h.file[i].name.c_str());
+  printf("%-24s %-17s %s\n", "shrunk files", "", failures==before ? "ok"
+    : "FAILED");
+}
+
+// Blocks of noise are stored by probeBlocks() and extracted as stored
+static void testStored() {
+  const int before=failures;
+  vector<U8> in(PROBE);
+  check(entropyEstimate(&in[0], in.size())<0.01, "entropy of zeros");
+  makeInput(in, PROBE);
+  const double text=entropyEstimate(&in[0], in.size());
+  U32 x=1;
+  for (size_t i=0; i<in.size(); ++i)
+    in[i]=(x=x*1103515245+12345)>>24;
+  const double noise=entropyEstimate(&in[0], in.size());
+  check(text<6 && noise>storebits, "entropy of text and noise");
+
+  // A block per file, of which in2.tmp is noise
+  ArchiveHeader h;
+  makeFiles(h);
+  h.block.clear();
+  for (int i=0; i<int(h.file.size()); ++i)
+    addBlock(h, h.file[i].offset, h.file[i].size, AC64);
+  probeBlocks(h);
+  check(h.block[0].coder==AC64 && h.block[1].coder==AC64
+    && h.block[2].coder==STORED, "probeBlocks()");
+  writeArchive("stored.tmp", h, 0);
+  check(h.block[2].csize==h.block[2].usize, "stored block size");
+  vector<U8> serial, threaded;
+  readFile("stored.tmp", serial);
+  writeArchive("threads.tmp", h, 2);
+  readFile("threads.tmp", threaded);
+  check(threaded==serial, "stored compressBlocks() same as BlockWriter");
+  checkExtract("stored.tmp", 1, "stored");
+  checkExtract("stored.tmp", 2, "stored with threads");
+  remove("stored.tmp");
+  remove("threads.tmp");
+  for (int i=0; i<int(h.file.size()); ++i)
+    remove(h.file[i].name.c_str());
+  printf("%-24s %-17s %s\n", "stored blocks", "", failures==before ? "ok"
+    : "FAILED");
+}
+
+// Each archive format version read, written by the build that last
+// wrote it.  The current version is also written, and must match its
+// golden vector.
+static const Golden archive_golden={86929, 0xc688d5ab};  // Version 6
+
+static void testVersions() {
+  const int before=failures;
+
+  // Version 5, written by the build of user-023 from makeInput(20000)
+  vector<U8> in;
+  makeInput(in, 20000);
+  FILE* f=fopen("v5.in", "wb");
+  if (f) {
+    fwrite(&in[0], 1, in.size(), f);
+    fclose(f);
+  }
+  checkExtract("v5.paq", 1, "version 5");
+  remove("v5.in");
+
+  // Version 6
+  ArchiveHeader h;
+  makeFiles(h);
+  makeBlocks(h, 50000, AC32);
+  writeArchive("v6.tmp", h, 0);
+  vector<U8> v6;
+  readFile("v6.tmp", v6);
+  check(v6.size()>4 && v6[4]==6, "version 6 written");
+  report("archive version 6", v6, archive_golden);
+  checkExtract("v6.tmp", 1, "version 6");
+  remove("v6.tmp");
+  for (int i=0; i<int(h.file.size()); ++i)
+    remove(h.file[i].name.c_str());
+
+  // Stream text headers record the Predictor
+  static const char* streams[][3]={{"ppm", "bcm", "01"}, {"ppm4", "c",
+    "2"}, {"none", "-", "-"}};
+  for (int i=0; i<3; ++i) {
+    const string name=string("stream header ")+streams[i][0];
+    f=tmpfile();
+    if (!f) {
+      check(false, name+" tmpfile()");
+      break;
+    }
+    fprintf(f, "%s\r\nstream crc32c model %s mixer %s apm %s\r\n\032\f",
+      coderTag(RANS4), streams[i][0], streams[i][1], streams[i][2]);
+    putc(0, f);
+    rewind(f);
+    ArchiveHeader hs;
+    const bool ok=hs.read(f);
+    check(ok && hs.stream && hs.block.size()==1
+      && hs.block[0].coder==RANS4
+      && hs.block[0].model==modelOfName(streams[i][0])
+      && hs.block[0].mixer==mixerContexts(streams[i][1])
+      && hs.block[0].apm==apmContexts(streams[i][2])
+      && hs.block[0].offset==U64(ftell64(f)), name);
+    fclose(f);
+  }
+  printf("%-24s %-17s %s\n", "archive versions", "", failures==before
+    ? "ok" : "FAILED");
+}
+
+int main() {
+  testCoders();
+  testCRC();
+  testKernels();
+  testWriter();
+  testArchives();
+  testShrunk();
+  testStored();
+  testVersions();
+  if (failures)
+    printf("%d tests FAILED\n", failures);
+  else
+    printf("All tests passed\n");
+  return failures;
+}
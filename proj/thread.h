@@ -0,0 +1,213 @@
+#ifndef _THREAD_
+#define _THREAD_
+
+#include "models/utils/datatypes.h"
+
+/* Threads, after zpaq.  THREADS is defined if threads are supported
+(Pthreads, unix only, link with -pthread).  Otherwise the callers do the
+work themselves in one thread.
+
+   ThreadID tid;
+   run(tid, f, arg) starts ThreadReturn f(void* arg) in a new thread.
+     f must return 0.
+   join(tid) waits for it to return.
+
+   Mutex m;
+   init_mutex(m) initializes m unlocked.
+   lock(m) waits for m and locks it.
+   release(m) unlocks it.
+   destroy_mutex(m) frees its resources.
+
+   Semaphore sem;
+   sem.init(n) sets the count to n >= 0.
+   sem.wait() waits until the count is positive, then decrements it.
+   sem.signal() increments the count, waking a waiting thread.
+   sem.destroy() frees its resources.
+
+   A Ring is a lock-free queue of slot numbers 0..n-1 from exactly one
+   producer thread to exactly one consumer thread, used to pass buffers
+   without copying.  The producer fills slot back() and calls push().
+   The consumer reads slot front() and calls pop() to give it back.
+   push() publishes the slot contents to the consumer, and pop() hands
+   the slot back to the producer, so neither needs a lock.
+   full() (producer) and empty() (consumer) say whether to wait.
+   close() (producer) says no more slots will be pushed, and closed()
+   (consumer) tests it.  cancel() (consumer) asks the producer to stop,
+   and cancelled() (producer) tests it.
+   wait(spins) waits a little while, longer as ++spins grows, for
+   polling the ring when it is full or empty.
+
+   NUMA placement, Linux only (elsewhere these do nothing):
+   pinThread(i) binds the calling thread to the i'th (mod their number)
+     of the CPUs the process may run on, and sets its memory policy to
+     allocate pages on the NUMA node of the CPU it runs on when it first
+     touches them (MPOL_LOCAL), so memory it allocates and initializes
+     stays local.  Returns the CPU, or -1 if it cannot.
+   pinThread(-1) undoes it, letting the thread run on any CPU again.
+   pageNodes(p, n, count) adds to count[k] the number of pages of
+     p[0..n-1] on node k for k < MAXNODES, and returns the number of
+     other pages: not yet touched, or on an unknown node.  It uses the
+     move_pages system call, which only queries when given no nodes.
+*/
+
+#ifdef __unix__
+#define THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+typedef void* ThreadReturn;
+typedef pthread_t ThreadID;
+inline void run(ThreadID& tid, ThreadReturn(*f)(void*), void* arg) {
+  pthread_create(&tid, 0, f, arg);
+}
+inline void join(ThreadID tid) {pthread_join(tid, 0);}
+
+typedef pthread_mutex_t Mutex;
+inline void init_mutex(Mutex& m) {pthread_mutex_init(&m, 0);}
+inline void lock(Mutex& m) {pthread_mutex_lock(&m);}
+inline void release(Mutex& m) {pthread_mutex_unlock(&m);}
+inline void destroy_mutex(Mutex& m) {pthread_mutex_destroy(&m);}
+
+class Semaphore {
+  pthread_cond_t cv;      // Signals a positive count
+  pthread_mutex_t mutex;  // Protects cv and sem
+  int sem;                // Count, or -1 if not initialized
+public:
+  Semaphore(): sem(-1) {}
+  void init(int n) {
+    pthread_cond_init(&cv, 0);
+    pthread_mutex_init(&mutex, 0);
+    sem=n;
+  }
+  void destroy() {
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cv);
+  }
+  void wait() {
+    pthread_mutex_lock(&mutex);
+    while (sem==0)
+      pthread_cond_wait(&cv, &mutex);
+    --sem;
+    pthread_mutex_unlock(&mutex);
+  }
+  void signal() {
+    pthread_mutex_lock(&mutex);
+    ++sem;
+    pthread_cond_signal(&cv);
+    pthread_mutex_unlock(&mutex);
+  }
+};
+#endif
+
+enum {MAXNODES=64};
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// The CPUs the process may run on, saved before any thread is pinned
+inline cpu_set_t processCPUs() {
+  cpu_set_t all;
+  CPU_ZERO(&all);
+  sched_getaffinity(0, sizeof(all), &all);
+  return all;
+}
+
+inline int pinThread(int i) {
+  static const cpu_set_t all=processCPUs();
+  enum {MPOL_DEFAULT_=0, MPOL_LOCAL_=4};  // From <numaif.h>
+  if (i<0) {
+    sched_setaffinity(0, sizeof(all), &all);
+    syscall(SYS_set_mempolicy, MPOL_DEFAULT_, 0, 0);
+    return -1;
+  }
+  const int n=CPU_COUNT(&all);
+  if (n<1)
+    return -1;
+  i%=n;
+  for (int cpu=0; cpu<CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &all) && i--==0) {
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpu, &one);
+      if (sched_setaffinity(0, sizeof(one), &one)!=0)
+        return -1;
+      syscall(SYS_set_mempolicy, MPOL_LOCAL_, 0, 0);
+      return cpu;
+    }
+  }
+  return -1;
+}
+
+inline size_t pageNodes(const void* p, size_t n, size_t* count) {
+  const size_t page=sysconf(_SC_PAGESIZE);
+  size_t a=size_t(p)/page*page;
+  const size_t end=size_t(p)+n;
+  size_t other=0;
+  while (a<end) {
+    enum {BATCH=256};
+    void* pages[BATCH];
+    int status[BATCH];
+    int k=0;
+    for (; k<BATCH && a<end; ++k, a+=page)
+      pages[k]=(void*)a;
+    if (syscall(SYS_move_pages, 0, k, pages, 0, status, 0)!=0) {
+      other+=k;
+      continue;
+    }
+    for (int j=0; j<k; ++j) {
+      if (status[j]>=0 && status[j]<MAXNODES)
+        ++count[status[j]];
+      else
+        ++other;
+    }
+  }
+  return other;
+}
+
+#else
+inline int pinThread(int i) {return -1;}
+inline size_t pageNodes(const void* p, size_t n, size_t* count) {
+  return (n+4095)/4096;
+}
+#endif
+
+class Ring {
+  const U32 n;       // Number of slots
+  U32 head;          // Slots pushed
+  U32 tail;          // Slots popped
+  int done;          // Set by close()
+  int stop;          // Set by cancel()
+  U32 get(const U32& x) const {return __atomic_load_n(&x, __ATOMIC_ACQUIRE);}
+public:
+  Ring(U32 slots): n(slots), head(0), tail(0), done(0), stop(0) {}
+  U32 size() const {return n;}
+
+  // Producer
+  bool full() const {return head-get(tail)>=n;}
+  U32 back() const {return head%n;}
+  void push() {__atomic_store_n(&head, head+1, __ATOMIC_RELEASE);}
+  void close() {__atomic_store_n(&done, 1, __ATOMIC_RELEASE);}
+  bool cancelled() const {return __atomic_load_n(&stop, __ATOMIC_ACQUIRE);}
+
+  // Consumer
+  bool empty() const {return get(head)==tail;}
+  U32 front() const {return tail%n;}
+  void pop() {__atomic_store_n(&tail, tail+1, __ATOMIC_RELEASE);}
+  bool closed() const {return __atomic_load_n(&done, __ATOMIC_ACQUIRE);}
+  void cancel() {__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);}
+
+  static void wait(int& spins) {
+#ifdef THREADS
+    if (++spins<64)
+      sched_yield();
+    else {
+      timespec ts={0, spins<1000 ? 50000 : 1000000};  // 50 us, then 1 ms
+      nanosleep(&ts, 0);
+    }
+#endif
+  }
+};
+
+#endif